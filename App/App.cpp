@@ -42,6 +42,13 @@
 #include "App.h"
 #include "Enclave_u.h"
 #include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <thread>
+#include <chrono>
+#include <vector>
 //#include "../Enclave/Enclave.h"
 
 //these definitions are for the baseline. To change the real settings, see Enclave.h
@@ -252,6 +259,35 @@ void ocall_print_string(const char *str)
     printf("%s", str);
 }
 
+void ocall_hotcall_idle()
+{
+    std::this_thread::sleep_for(std::chrono::microseconds(50));
+}
+
+/* ocall_save_sealed: append one record of a sealed automaton set to SEALED_FILENAME, as unsealDFASet reads it back */
+int ocall_save_sealed(const uint8_t* record, uint32_t length, uint32_t index)
+{
+    FILE* f = fopen(SEALED_FILENAME, index == 0 ? "wb" : "ab");
+    if(!f) return -1;
+    int ret = (fwrite(&length, sizeof(length), 1, f) == 1 && fwrite(record, 1, length, f) == length) ? 0 : -1;
+    if(fclose(f) != 0) ret = -1;
+    return ret;
+}
+
+/* mapFile: map a whole file read-only for an ecall that reads it in place, NULL if it cannot be mapped */
+void* mapFile(const char* name, size_t* size)
+{
+    int fd = open(name, O_RDONLY);
+    struct stat st;
+    void* data = MAP_FAILED;
+    if(fd != -1 && fstat(fd, &st) == 0 && st.st_size > 0){
+        data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        *size = st.st_size;
+    }
+    if(fd != -1) close(fd);
+    return data == MAP_FAILED ? NULL : data;
+}
+
 int prepDFA(){ //our hard-coded regex: *D.?A.?R.?P.?A*
     //NOTE: code from this function is for testing only! It would not provide security in a real enclave because the code is visible to outsiders. 
     //  It would have to be loaded encrypted from outside
@@ -367,13 +403,74 @@ int runDFABaseline(char* data, int length){
 
 
 
-/* Application entry */
-int SGX_CDECL main(int argc, char *argv[])
+/* provisionFile: send an encrypted set written by dfac -k to the enclave chunk by chunk, returns its pattern count or -1 */
+int provisionFile(const char* name)
+{
+    size_t size = 0, off = 8;
+    int ret = -1;
+    uint8_t* data = (uint8_t*)mapFile(name, &size);
+    if(!data) return -1;
+    if(size >= off) beginProvision(global_eid, &ret, data);
+    while(ret == 0 && size-off >= sizeof(dfa_chunk_header_t)){
+        dfa_chunk_header_t chunk;
+        memcpy(&chunk, data+off, sizeof(chunk));
+        off += sizeof(chunk);
+        if(chunk.length > size-off){
+            ret = -1;
+            break;
+        }
+        provisionChunk(global_eid, &ret, data+off, chunk.length, chunk.mac, chunk.last);
+        off += chunk.length;
+        if(chunk.last) break;
+    }
+    munmap(data, size);
+    return ret > 0 ? ret : -1;
+}
+
+#define SESSION_CHUNK 4096 //bytes per feedSession call
+
+/* scanParallel: runDFAParallel with numWorkers enclave threads besides the caller */
+int scanParallel(const char* data, int length, int numWorkers)
 {
-    (void)(argc);
-    (void)(argv);
+    int acceptLoc = -1;
+    std::thread workers[9]; //MAX_WORKERS in Enclave.h
+    if(numWorkers > 9) numWorkers = 9;
+    for(int i = 0; i < numWorkers; i++){
+        workers[i] = std::thread([]{ int ret; runDFAWorker(global_eid, &ret); });
+    }
+    runDFAParallel(global_eid, &acceptLoc, (char*)data, length, numWorkers);
+    for(int i = 0; i < numWorkers; i++){
+        workers[i].join();
+    }
+    return acceptLoc;
+}
 
+/* hotcall: post a request to the ring and spin until an enclave worker has answered it */
+int64_t hotcall(hotcall_ring_t* ring, int op, int session, char* data, int length)
+{
+    hotcall_request_t* req;
+    for(;;){
+        unsigned int slot = (unsigned int)__sync_fetch_and_add(&ring->next, 1) % HOTCALL_SLOTS;
+        req = &ring->slots[slot];
+        if(__sync_bool_compare_and_swap(&req->status, HOTCALL_FREE, HOTCALL_CLAIMED)) break;
+        std::this_thread::yield();
+    }
+    req->op = op;
+    req->session = session;
+    req->data = data;
+    req->length = length;
+    __sync_synchronize();
+    req->status = HOTCALL_POSTED;
+    while(req->status != HOTCALL_DONE) __builtin_ia32_pause();
+    __sync_synchronize();
+    int64_t result = req->result;
+    req->status = HOTCALL_FREE;
+    return result;
+}
 
+/* Application entry */
+int SGX_CDECL main(int argc, char *argv[])
+{
     /* Initialize the enclave */
     if(initialize_enclave() < 0){
         //printf("Enter a character before exit ...\n");
@@ -394,6 +491,14 @@ int SGX_CDECL main(int argc, char *argv[])
     int acceptLoc = -1;
     printf("preparing automata\n");
     prepDFA(global_eid, &status);
+    if(status != 0){
+        printf("the built-in pattern did not compile\n");
+        sgx_destroy_enclave(global_eid);
+        return -1;
+    }
+    int tier = 0;
+    getTier(global_eid, &tier);
+    printf("automata padded to %d states\n", tier);
     //prepDFA();
 
     
@@ -416,6 +521,159 @@ int SGX_CDECL main(int argc, char *argv[])
         printf("match found! accepted at position %d\n", acceptLoc);
     }
 
+    //several patterns in one pass: each gets its own first match position
+    const char* patterns = "D.?A.?R.?P.?A\nO.?L\nD.?L.?L";
+    int numPatterns = 0;
+    int acceptLocs[8];
+    prepDFASet(global_eid, &numPatterns, patterns);
+    if(numPatterns < 0){ //nothing was loaded, so the scans below would run the previous set
+        printf("%s\n", numPatterns == DFA_TOO_LARGE ? "a pattern needs more states than the largest tier allows" :
+               "the patterns did not compile");
+        sgx_destroy_enclave(global_eid);
+        return -1;
+    }
+    getTier(global_eid, &tier);
+    printf("loaded %d patterns, largest automaton padded to %d states\n", numPatterns, tier);
+    startTime = clock();
+    runDFAMulti(global_eid, &status, s4, l4, acceptLocs, 8);
+    endTime = clock();
+    elapsedTime = (double)(endTime - startTime)/(CLOCKS_PER_SEC);
+    printf("running time: %.5fs\n", elapsedTime);
+    for(int p = 0; p < numPatterns; p++){
+        printf("pattern %d: %s %d\n", p, acceptLocs[p] == -1 ? "no match" : "first match at", acceptLocs[p]);
+    }
+
+    //the same patterns with every row fetched through each ORAM in turn, then back to the cheapest per tier
+    const int oramBackends[] = {DFA_BACKEND_ORAM, DFA_BACKEND_CIRCUIT, DFA_BACKEND_RING};
+    const char* oramNames[] = {"Path ORAM", "Circuit ORAM", "Ring ORAM"};
+    int onOram = 0;
+    for(int b = 0; b < 3; b++){
+        setBackend(global_eid, &onOram, oramBackends[b]);
+        initDFA(global_eid, &status);
+        startTime = clock();
+        runDFA(global_eid, &acceptLoc, s3, l3);
+        endTime = clock();
+        elapsedTime = (double)(endTime - startTime)/(CLOCKS_PER_SEC);
+        printf("%d automata on %s: %.5fs, first match at %d\n", onOram, oramNames[b], elapsedTime, acceptLoc);
+    }
+    setBackend(global_eid, &onOram, DFA_BACKEND_AUTO);
+    printf("auto backend: %d automata on ORAM\n", onOram);
+
+    //one document split across enclave threads
+    initDFA(global_eid, &status);
+    startTime = clock();
+    acceptLoc = scanParallel(s4, l4, 4);
+    endTime = clock();
+    elapsedTime = (double)(endTime - startTime)/(CLOCKS_PER_SEC);
+    printf("parallel running time: %.5fs, first match at %d\n", elapsedTime, acceptLoc);
+
+    //the same document read in place from untrusted memory
+    initDFA(global_eid, &status);
+    runDFAUntrusted(global_eid, &acceptLoc, s4, l4);
+    printf("scanned in place, first match at %d\n", acceptLoc);
+
+    //the same document streamed in fixed-size chunks; only one chunk is in the enclave at a time
+    int session = -1;
+    int64_t sessionLocs[8], sessionLoc = -1;
+    openSession(global_eid, &session);
+    for(int off = 0; off < l4; off += SESSION_CHUNK){
+        feedSession(global_eid, &status, session, s4+off, (l4-off < SESSION_CHUNK) ? l4-off : SESSION_CHUNK);
+    }
+    finalizeSession(global_eid, &status, session, sessionLocs, 8, &sessionLoc);
+    printf("streamed in %d-byte chunks, first match at %lld\n", SESSION_CHUNK, (long long)sessionLoc);
+
+    //one request per line through the hotcall ring, served by enclave workers without enclave transitions
+    static hotcall_ring_t ring;
+    std::thread servers[2];
+    for(int i = 0; i < 2; i++){
+        servers[i] = std::thread([]{ int served; hotcallServe(global_eid, &served, &ring); });
+    }
+    int lines = 0, matched = 0;
+    startTime = clock();
+    for(char* line = s4; line < s4+l4; ){
+        char* end = strchr(line, ';');
+        int length = end ? end-line : (int)strlen(line);
+        matched += (hotcall(&ring, HOTCALL_RUN, 0, line, length) != -1);
+        lines++;
+        line += length+1;
+    }
+    endTime = clock();
+    ring.stop = 1;
+    for(int i = 0; i < 2; i++){
+        servers[i].join();
+    }
+    elapsedTime = (double)(endTime - startTime)/(CLOCKS_PER_SEC);
+    printf("hotcall: %d of %d lines matched in %.5fs\n", matched, lines, elapsedTime);
+
+    //two pattern sets queried in turn: each is compiled and has its ORAMs set up once, then reused by handle
+    const char* sets[2] = {"D.?A.?R.?P.?A\nO.?L", "D.?L.?L\nhflk"};
+    int handles[2];
+    startTime = clock();
+    for(int q = 0; q < 20; q++){
+        cacheDFASet(global_eid, &handles[q%2], sets[q%2]);
+        useDFASet(global_eid, &numPatterns, handles[q%2]);
+        runDFA(global_eid, &acceptLoc, s3, l3);
+    }
+    endTime = clock();
+    elapsedTime = (double)(endTime - startTime)/(CLOCKS_PER_SEC);
+    printf("20 queries over 2 cached sets: %.5fs, last first match at %d\n", elapsedTime, acceptLoc);
+
+    //the loaded set sealed to disk and restored as after a restart, without compiling or rebuilding its ORAMs
+    int records = 0;
+    sealDFASet(global_eid, &records);
+    size_t sealedSize = 0;
+    void* sealed = records > 0 ? mapFile(SEALED_FILENAME, &sealedSize) : NULL;
+    if(sealed){
+        startTime = clock();
+        unsealDFASet(global_eid, &numPatterns, (const uint8_t*)sealed, sealedSize);
+        endTime = clock();
+        munmap(sealed, sealedSize);
+        elapsedTime = (double)(endTime - startTime)/(CLOCKS_PER_SEC);
+        runDFA(global_eid, &acceptLoc, s3, l3);
+        printf("restored %d patterns from %d sealed records in %.5fs, first match at %d\n", numPatterns, records, elapsedTime, acceptLoc);
+    }
+
+    //a set compiled ahead of time with dfac: the image is mapped and the enclave copies it straight into its tables
+    if(argc > 1){
+        size_t size = 0;
+        void* image = mapFile(argv[1], &size);
+        if(!image){
+            printf("cannot map %s\n", argv[1]);
+        }
+        else{
+            loadDFAImage(global_eid, &numPatterns, (const uint8_t*)image, size);
+            munmap(image, size);
+            printf("loaded %d patterns from %s\n", numPatterns, argv[1]);
+            std::vector<int> imageLocs(numPatterns > 0 ? numPatterns : 1);
+            initDFA(global_eid, &status);
+            runDFAMulti(global_eid, &status, s4, l4, imageLocs.data(), numPatterns);
+            for(int p = 0; p < numPatterns; p++){
+                printf("pattern %d: %s %d\n", p, imageLocs[p] == -1 ? "no match" : "first match at", imageLocs[p]);
+            }
+        }
+    }
+
+    //an encrypted set: the chunks are decrypted and parsed in the enclave one at a time
+    //NOTE: the App reading the key from a file is for testing; it would normally reach the enclave over an attested channel
+    if(argc > 3){
+        std::vector<uint8_t> key(16);
+        FILE* f = fopen(argv[3], "rb");
+        if(f && fread(key.data(), 1, key.size(), f) == key.size()){
+            setProvisionKey(global_eid, &status, key.data());
+            numPatterns = provisionFile(argv[2]);
+            printf("provisioned %d encrypted patterns from %s\n", numPatterns, argv[2]);
+            if(numPatterns > 0){
+                initDFA(global_eid, &status);
+                runDFA(global_eid, &acceptLoc, s4, l4);
+                printf("first match at %d\n", acceptLoc);
+            }
+        }
+        else{
+            printf("cannot read a 16-byte key from %s\n", argv[3]);
+        }
+        if(f) fclose(f);
+    }
+
     /* Destroy the enclave */
     sgx_destroy_enclave(global_eid);
 
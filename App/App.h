@@ -51,6 +51,7 @@
 
 # define TOKEN_FILENAME   "enclave.token"
 # define ENCLAVE_FILENAME "enclave.signed.so"
+# define SEALED_FILENAME  "dfaset.sealed"
 
 extern sgx_enclave_id_t global_eid;    /* global enclave id */
 
@@ -0,0 +1,519 @@
+#include "Enclave.h"
+#include "Regex.h"
+
+//Building automata from patterns: staging, alphabet compression, minimization, products and packing.
+//Nothing here touches the loaded set or calls out of the enclave, so the dfac tool links the same code
+
+int nextPowerOfTwo(unsigned int v){
+	v--;
+	v |= v >> 1;
+	v |= v >> 2;
+	v |= v >> 4;
+	v |= v >> 8;
+	v |= v >> 16;
+	v++;
+	return v;
+}
+
+int compressAlphabet(Staged_Dfa* dfa){
+    //group classes whose columns agree in every row into one class, then shrink rows to the smallest
+    //tier in CLASS_TIERS that fits. Replaces the rows with ones at the new width and composes classMap,
+    //so it can be run again after the rows change (e.g. after minimizeDFA)
+    //returns the number of classes, or -1 if out of memory (the DFA is left as it was)
+    int old = dfa->numClasses, rows = dfa->numStates;
+    const uint16_t* src = dfa->rows;
+    int reps[256]; //first old column of each new class, in increasing order
+    int merged[256]; //old column -> new class
+    int classes = 0;
+    for(int c = 0; c < old; c++){
+        int cls = classes;
+        for(int j = 0; j < classes && cls == classes; j++){
+            int same = 1;
+            for(int s = 0; s < rows && same; s++){
+                same = (src[s*old+c] == src[s*old+reps[j]]);
+            }
+            if(same) cls = j;
+        }
+        if(cls == classes) reps[classes++] = c;
+        merged[c] = cls;
+    }
+
+    int width = classTier(classes);
+    uint16_t* packed = (uint16_t*)calloc(rows*width, sizeof(uint16_t)); //padding columns stay 0
+    if(!packed) return -1;
+    for(int s = 0; s < rows; s++){
+        for(int j = 0; j < classes; j++){
+            packed[s*width+j] = src[s*old+reps[j]];
+        }
+    }
+    free(dfa->rows);
+    dfa->rows = packed;
+    dfa->numClasses = width;
+    for(int c = 0; c < 256; c++){
+        dfa->classMap[c] = merged[dfa->classMap[c]];
+    }
+    return classes;
+}
+
+int minimizeDFA(Staged_Dfa* dfa){
+    //Hopcroft minimization of the staged rows; states are only merged if they have the same accept mask
+    //drops unreachable states, merges equivalent ones and renumbers so the start state stays 0
+    //rows and masks are rewritten in place. Returns the new number of states
+    //runs before padding, on data that has not reached the ORAM yet, so it is not oblivious
+    int rows = dfa->numStates, w = dfa->numClasses;
+    uint16_t* staged = dfa->rows;
+    int* accStates = dfa->accStates;
+    int n = 0, m = 0;
+    int *id = (int*)malloc(rows*sizeof(int)); //old state -> index among reachable states, -1 if unreachable
+    int *order = (int*)malloc(rows*sizeof(int)); //reachable index -> old state, in BFS order from the start state
+    int *predStart = (int*)malloc((w*rows+1)*sizeof(int)); //predecessors of t on a are preds[predStart[a*n+t]..predStart[a*n+t+1])
+    int *preds = (int*)malloc(w*rows*sizeof(int));
+    int *elems = (int*)malloc(rows*sizeof(int)); //states grouped by block
+    int *loc = (int*)malloc(rows*sizeof(int)); //position of each state in elems
+    int *blk = (int*)malloc(rows*sizeof(int)); //block of each state
+    int *first = (int*)malloc(rows*sizeof(int)); //block b is elems[first[b]..end[b]), marked states come before mid[b]
+    int *end = (int*)malloc(rows*sizeof(int));
+    int *mid = (int*)malloc(rows*sizeof(int));
+    int *work = (int*)malloc(rows*sizeof(int)); //splitters still to process
+    int *inWork = (int*)malloc(rows*sizeof(int));
+    int *touched = (int*)malloc(rows*sizeof(int)); //blocks with marked states
+    int *splitter = (int*)malloc(rows*sizeof(int)); //copy of the splitter being processed
+    int *newId = (int*)malloc(rows*sizeof(int)); //block -> new state number
+    int *rep = (int*)malloc(rows*sizeof(int)); //new state number -> lowest old state in it
+    if(!id || !order || !predStart || !preds || !elems || !loc || !blk || !first || !end || !mid
+        || !work || !inWork || !touched || !splitter || !newId || !rep){
+        m = rows; //not enough memory, leave the DFA as it is
+        goto done;
+    }
+
+    //reachable states
+    for(int s = 0; s < rows; s++) id[s] = -1;
+    id[0] = 0;
+    order[n++] = 0;
+    for(int i = 0; i < n; i++){
+        for(int a = 0; a < w; a++){
+            int t = staged[order[i]*w+a];
+            if(id[t] == -1){
+                id[t] = n;
+                order[n++] = t;
+            }
+        }
+    }
+
+    //inverse transitions
+    memset(predStart, 0, (w*n+1)*sizeof(int));
+    for(int i = 0; i < n; i++){
+        for(int a = 0; a < w; a++){
+            predStart[a*n+id[staged[order[i]*w+a]]+1]++;
+        }
+    }
+    for(int k = 0; k < w*n; k++) predStart[k+1] += predStart[k];
+    for(int a = 0; a < w; a++){
+        for(int t = 0; t < n; t++) mid[t] = predStart[a*n+t]; //mid is free until partitioning, use it as a fill cursor
+        for(int i = 0; i < n; i++){
+            int t = id[staged[order[i]*w+a]];
+            preds[mid[t]++] = i;
+        }
+    }
+
+    //initial partition: one block per accept mask, in order of first appearance
+    {
+        int numBlocks = 0, top = 0, numTouched = 0, pos = 0, largest = 0;
+        for(int i = 0; i < n; i++) blk[i] = -1;
+        for(int i = 0; i < n; i++){
+            if(blk[i] != -1) continue;
+            first[numBlocks] = pos;
+            for(int j = i; j < n; j++){
+                if(blk[j] == -1 && accStates[order[j]] == accStates[order[i]]){
+                    elems[pos] = j;
+                    loc[j] = pos;
+                    blk[j] = numBlocks;
+                    pos++;
+                }
+            }
+            end[numBlocks] = pos;
+            mid[numBlocks] = first[numBlocks];
+            if(end[numBlocks]-first[numBlocks] > end[largest]-first[largest]) largest = numBlocks;
+            numBlocks++;
+        }
+        //every initial block but the largest needs to be a splitter
+        for(int b = 0; b < numBlocks; b++){
+            inWork[b] = (b != largest);
+            if(inWork[b]) work[top++] = b;
+        }
+
+        while(top > 0){
+            int S = work[--top];
+            int size = end[S]-first[S];
+            inWork[S] = 0;
+            memcpy(splitter, &elems[first[S]], size*sizeof(int));
+            for(int a = 0; a < w; a++){
+                //mark every state that moves into the splitter on a
+                for(int e = 0; e < size; e++){
+                    int t = splitter[e];
+                    for(int k = predStart[a*n+t]; k < predStart[a*n+t+1]; k++){
+                        int p = preds[k], b = blk[p], i = loc[p], j = mid[b];
+                        if(i < j) continue; //already marked
+                        elems[i] = elems[j];
+                        loc[elems[i]] = i;
+                        elems[j] = p;
+                        loc[p] = j;
+                        if(mid[b] == first[b]) touched[numTouched++] = b;
+                        mid[b]++;
+                    }
+                }
+                //split touched blocks into their marked and unmarked parts
+                for(int k = 0; k < numTouched; k++){
+                    int b = touched[k];
+                    if(mid[b] == end[b]){
+                        mid[b] = first[b];
+                        continue;
+                    }
+                    int nb = numBlocks++;
+                    first[nb] = first[b];
+                    end[nb] = mid[b];
+                    mid[nb] = first[nb];
+                    first[b] = mid[b];
+                    for(int i = first[nb]; i < end[nb]; i++) blk[elems[i]] = nb;
+                    if(inWork[b] || end[nb]-first[nb] <= end[b]-first[b]){
+                        work[top++] = nb;
+                        inWork[nb] = 1;
+                    }
+                    else{
+                        work[top++] = b;
+                        inWork[b] = 1;
+                        inWork[nb] = 0;
+                    }
+                }
+                numTouched = 0;
+            }
+        }
+
+        //renumber blocks in order of their lowest old state; the start state's block becomes 0
+        for(int b = 0; b < numBlocks; b++) newId[b] = -1;
+        for(int s = 0; s < rows; s++){
+            if(id[s] == -1) continue;
+            int b = blk[id[s]];
+            if(newId[b] == -1){
+                newId[b] = m;
+                rep[m++] = s;
+            }
+        }
+    }
+
+    //rep[i] >= i, so rewriting rows and masks forward never overwrites one that is still needed
+    for(int i = 0; i < m; i++){
+        uint16_t tmp[256];
+        for(int a = 0; a < w; a++){
+            tmp[a] = newId[blk[id[staged[rep[i]*w+a]]]];
+        }
+        memcpy(&staged[i*w], tmp, w*sizeof(uint16_t));
+        accStates[i] = accStates[rep[i]];
+    }
+    dfa->numStates = m;
+
+done:
+    free(id); free(order); free(predStart); free(preds); free(elems); free(loc); free(blk); free(first);
+    free(end); free(mid); free(work); free(inWork); free(touched); free(splitter); free(newId); free(rep);
+    return m;
+}
+
+int shrinkDFA(Staged_Dfa* dfa){
+    //shrink before padding: merge input bytes, minimize on the merged alphabet, then merge again
+    //since states that became one may have been all that told two classes apart
+    //returns the number of states, or -1 if out of memory
+    if(compressAlphabet(dfa) < 0) return -1;
+    int states = minimizeDFA(dfa);
+    if(compressAlphabet(dfa) < 0) return -1;
+    return states;
+}
+
+int productDFA(const Staged_Dfa* a, const Staged_Dfa* b, Staged_Dfa* out){
+    //stage the automaton that runs a and b side by side: its states are the pairs (state of a, state of b)
+    //reachable from (0,0), and each accepts the patterns of both, b's on the accept bits above a's
+    //fails (-1) if the pairs outgrow the largest tier, the patterns outgrow MAX_ACCEPT_BITS or memory runs out
+    //the result is not minimized
+    int maxStates = STATE_TIERS[NUM_STATE_TIERS-1];
+    int hashSize = 2*nextPowerOfTwo(maxStates); //open addressing, at most half full
+    int colA[256], colB[256]; //product class -> column in a and in b
+    uint8_t map[256];
+    int classes = 0, n = 1, ret = 0;
+    if(a->numPatterns + b->numPatterns > MAX_ACCEPT_BITS) return -1;
+
+    //product classes are the distinct (class in a, class in b) pairs
+    for(int c = 0; c < 256; c++){
+        int cls = classes;
+        for(int j = 0; j < classes && cls == classes; j++){
+            if(colA[j] == a->classMap[c] && colB[j] == b->classMap[c]) cls = j;
+        }
+        if(cls == classes){
+            colA[classes] = a->classMap[c];
+            colB[classes] = b->classMap[c];
+            classes++;
+        }
+        map[c] = cls;
+    }
+
+    int* keys = (int*)malloc(hashSize*sizeof(int)); //pair (sa, sb) is keyed sa*b->numStates+sb
+    int* vals = (int*)malloc(hashSize*sizeof(int));
+    int* pairs = (int*)malloc(maxStates*sizeof(int)); //product state -> key
+    uint16_t* rows = (uint16_t*)malloc(maxStates*classes*sizeof(uint16_t));
+    int* acc = (int*)malloc(maxStates*sizeof(int));
+    if(!keys || !vals || !pairs || !rows || !acc){
+        ret = -1;
+        goto done;
+    }
+    for(int h = 0; h < hashSize; h++) keys[h] = -1;
+    keys[0] = 0; //key 0 hashes to slot 0
+    vals[0] = 0;
+    pairs[0] = 0;
+
+    //breadth first from (0,0)
+    for(int i = 0; i < n && ret == 0; i++){
+        int sa = pairs[i] / b->numStates, sb = pairs[i] % b->numStates;
+        acc[i] = a->accStates[sa] | (b->accStates[sb] << a->numPatterns);
+        for(int j = 0; j < classes && ret == 0; j++){
+            int key = a->rows[sa*a->numClasses+colA[j]]*b->numStates + b->rows[sb*b->numClasses+colB[j]];
+            unsigned int h = ((unsigned int)key*2654435761u) & (hashSize-1);
+            while(keys[h] != -1 && keys[h] != key) h = (h+1) & (hashSize-1);
+            if(keys[h] == -1){
+                if(n == maxStates){
+                    ret = -1;
+                    break;
+                }
+                keys[h] = key;
+                vals[h] = n;
+                pairs[n++] = key;
+            }
+            rows[i*classes+j] = vals[h];
+        }
+    }
+    if(ret == 0){
+        out->rows = rows;
+        out->accStates = acc;
+        memcpy(out->classMap, map, sizeof(map));
+        out->numStates = n;
+        out->numClasses = classes;
+        out->numPatterns = a->numPatterns + b->numPatterns;
+        rows = NULL;
+        acc = NULL;
+    }
+
+done:
+    free(keys); free(vals); free(pairs); free(rows); free(acc);
+    return ret;
+}
+
+int stageDFA(Staged_Dfa* dfa, int rows){
+    //allocate zeroed staging rows for rows states at full 256-column width, reporting one pattern
+    dfa->rows = (uint16_t*)calloc(rows*256, sizeof(uint16_t));
+    dfa->accStates = (int*)calloc(rows, sizeof(int));
+    if(!dfa->rows || !dfa->accStates){
+        freeStagedDFA(dfa);
+        return -1;
+    }
+    dfa->numStates = rows;
+    dfa->numClasses = 256;
+    dfa->numPatterns = 1;
+    for(int c = 0; c < 256; c++) dfa->classMap[c] = c;
+    return 0;
+}
+
+void freeStagedDFA(Staged_Dfa* dfa){
+    free(dfa->rows); free(dfa->accStates);
+    dfa->rows = NULL;
+    dfa->accStates = NULL;
+}
+
+int stateTier(int rows){
+    //smallest tier in STATE_TIERS that holds rows states, -1 if none does
+    int tier = -1;
+    for(int i = NUM_STATE_TIERS-1; i >= 0; i--){
+        if(STATE_TIERS[i] >= rows) tier = STATE_TIERS[i];
+    }
+    return tier;
+}
+
+int classTier(int classes){
+    //smallest tier in CLASS_TIERS that holds classes columns, -1 if none does
+    int tier = -1;
+    for(int i = NUM_CLASS_TIERS-1; i >= 0; i--){
+        if(CLASS_TIERS[i] >= classes) tier = CLASS_TIERS[i];
+    }
+    return tier;
+}
+
+int scanCost(const Staged_Dfa* dfa){
+    //64-bit words a linear scan reads per input byte once dfa is padded and packed, -1 if it fits no tier
+    int tier = stateTier(dfa->numStates);
+    if(tier == -1) return -1;
+    int bits = 1;
+    while((1 << bits) < tier) bits++;
+    int perWord = 64/(bits+dfa->numPatterns);
+    return tier*((dfa->numClasses+perWord-1)/perWord);
+}
+
+Packed_Dfa* newDFA(int tier, int numClasses, int acceptBits){
+    //allocate a packed automaton of tier states and numClasses columns with a zeroed table, working out the
+    //entry layout from the id width of the tier. Returns NULL if the shape is not one padDFA produces or out of memory:
+    //both tier and numClasses must be tiers, as a table of any other size would show the real state or class count
+    if(stateTier(tier) != tier || classTier(numClasses) != numClasses || acceptBits < 1 || acceptBits > MAX_ACCEPT_BITS){
+        return NULL;
+    }
+    int bits = 1;
+    while((1 << bits) < tier) bits++;
+    int entry = bits + acceptBits;
+    int perWord = 64/entry;
+    int words = (numClasses+perWord-1)/perWord;
+
+    Packed_Dfa* out = (Packed_Dfa*)calloc(1, sizeof(Packed_Dfa));
+    uint64_t* table = (uint64_t*)calloc(tier*words, sizeof(uint64_t));
+    if(!out || !table){
+        free(out); free(table);
+        return NULL;
+    }
+    out->table = table;
+    out->numStates = tier;
+    out->numClasses = numClasses;
+    out->stateBits = bits;
+    out->acceptBits = acceptBits;
+    out->entryBits = entry;
+    out->entriesPerWord = perWord;
+    out->rowWords = words;
+    out->oram.blockSize = offsetof(Oram_Block, transitions) + words*sizeof(uint64_t);
+    return out;
+}
+
+Packed_Dfa* padDFA(const Staged_Dfa* dfa){
+    //pick the smallest tier in STATE_TIERS that holds the staged rows and pack them at that tier's id width.
+    //Each entry carries the accept mask of the state it leads to, so the staged masks are not needed once packed
+    //the tier is public, the number of real states is not. Returns NULL if nothing fits or out of memory
+    int tier = stateTier(dfa->numStates);
+    if(tier == -1) return NULL;
+    Packed_Dfa* out = newDFA(tier, dfa->numClasses, dfa->numPatterns);
+    if(!out) return NULL;
+    for(int s = 0; s < dfa->numStates; s++){
+        for(int j = 0; j < dfa->numClasses; j++){
+            int next = dfa->rows[s*dfa->numClasses+j];
+            uint64_t e = ((uint64_t)next << out->acceptBits) | dfa->accStates[next];
+            out->table[s*out->rowWords+j/out->entriesPerWord] |= e << ((j%out->entriesPerWord)*out->entryBits);
+        }
+    }
+    memcpy(out->classMap, dfa->classMap, sizeof(out->classMap));
+    return out;
+}
+
+void freeOram(Path_Oram* oram){
+    Path_Oram* last = oram; //levels share the first level's buckets, stash and metadata, the last one holds the position map
+    while(last->posOram) last = last->posOram;
+    free(oram->buckets); free(last->posMap); free(oram->stash); free(oram->meta); free(oram->posOram);
+    oram->buckets = NULL; oram->posMap = NULL; oram->stash = NULL; oram->meta = NULL; oram->posOram = NULL;
+}
+
+void freeDFA(Packed_Dfa* dfa){
+    if(!dfa) return;
+    freeOram(&dfa->oram);
+    free(dfa->table);
+    free(dfa);
+}
+
+void dfaEntry(const Packed_Dfa* dfa, dfa_image_entry_t* entry){
+    //describe a packed automaton the way images and sealed sets store it; newDFA rebuilds it from the same fields
+    memset(entry, 0, sizeof(*entry));
+    entry->numStates = dfa->numStates;
+    entry->numClasses = dfa->numClasses;
+    entry->stateBits = dfa->stateBits;
+    entry->acceptBits = dfa->acceptBits;
+    entry->entryBits = dfa->entryBits;
+    entry->entriesPerWord = dfa->entriesPerWord;
+    entry->rowWords = dfa->rowWords;
+    memcpy(entry->classMap, dfa->classMap, sizeof(entry->classMap));
+}
+
+Packed_Dfa* entryDFA(const dfa_image_entry_t* entry){
+    //allocate the packed automaton an entry describes, with its class map and a zeroed table. Returns NULL if the
+    //fields do not agree with the layout newDFA works out or a class is past the row (entries come from outside)
+    Packed_Dfa* dfa = newDFA(entry->numStates, entry->numClasses, entry->acceptBits);
+    int ok = (dfa != NULL);
+    if(ok){
+        ok = entry->stateBits == (uint32_t)dfa->stateBits && entry->entryBits == (uint32_t)dfa->entryBits
+            && entry->entriesPerWord == (uint32_t)dfa->entriesPerWord && entry->rowWords == (uint32_t)dfa->rowWords;
+    }
+    for(int c = 0; c < 256 && ok; c++){
+        ok = entry->classMap[c] < entry->numClasses;
+    }
+    if(!ok){
+        freeDFA(dfa);
+        return NULL;
+    }
+    memcpy(dfa->classMap, entry->classMap, sizeof(dfa->classMap));
+    return dfa;
+}
+
+int stagePatterns(const char* patterns, Staged_Dfa* dfas){
+    //compile one regex per line (see Regex.cpp) into dfas, which has room for MAX_PATTERNS, and shrink each one
+    //returns the number staged, or with nothing left allocated DFA_TOO_LARGE if a pattern outgrows the compiler's
+    //bounds, or -1 if a pattern is malformed, there are none or more than MAX_PATTERNS, or memory runs out
+    int count = 0, ret = 0;
+    const char* p = patterns;
+    while(*p && ret == 0){
+        const char* eol = p;
+        while(*eol && *eol != '\n') eol++;
+        if(eol > p){
+            if(count == MAX_PATTERNS){
+                ret = -1;
+                break;
+            }
+            ret = compileRegex(&dfas[count], p, eol-p);
+            if(ret != 0) break;
+            int before = dfas[count].numStates;
+            int states = shrinkDFA(&dfas[count]);
+            count++;
+            if(states < 0){
+                ret = -1;
+                break;
+            }
+            printf("DFA %d minimized from %d to %d states\n", count-1, before, states);
+        }
+        p = *eol ? eol+1 : eol;
+    }
+    if(ret != 0 || count == 0){
+        for(int i = 0; i < count; i++) freeStagedDFA(&dfas[i]);
+        return (ret == DFA_TOO_LARGE) ? ret : -1;
+    }
+    return count;
+}
+
+int packDFASet(Staged_Dfa* dfas, int count, Packed_Dfa** packed){
+    //pack count shrunk staged automata into packed, freeing their staging tables.
+    //Neighbours are merged into one product automaton while that does not make the scan per input byte
+    //more expensive than running them apart, so small patterns share a row scan
+    //grouping depends only on the patterns, never on input. Returns the number of automata, or -1 with none left
+    int num = 0, ret = 0, i = 0;
+    while(i < count && ret == 0){
+        Staged_Dfa group = dfas[i++];
+        while(i < count){
+            Staged_Dfa merged;
+            if(productDFA(&group, &dfas[i], &merged) != 0) break;
+            int states = shrinkDFA(&merged);
+            int cost = scanCost(&merged);
+            if(states < 0 || cost == -1 || cost > scanCost(&group)+scanCost(&dfas[i])){
+                freeStagedDFA(&merged);
+                break;
+            }
+            freeStagedDFA(&group);
+            freeStagedDFA(&dfas[i++]);
+            group = merged;
+        }
+        packed[num] = padDFA(&group);
+        freeStagedDFA(&group);
+        if(!packed[num]) ret = -1;
+        else num++;
+    }
+    for(; i < count; i++) freeStagedDFA(&dfas[i]);
+    if(ret != 0){
+        for(int d = 0; d < num; d++) freeDFA(packed[d]);
+        return -1;
+    }
+    return num;
+}
@@ -34,20 +34,36 @@
 #include <stdio.h>      /* vsnprintf */
 
 #include "Enclave.h"
+#include "Oblivious.h"
 #include "Enclave_t.h"  /* print_string */
+#include "sgx_tcrypto.h"
 
 
-Entry DFA[MAX_STATES*256] = {0};
-Oram_Bucket ORAM[MAX_STATES];
-unsigned int posMap[MAX_STATES];
-Oram_Block stash[2*STASH_SPACE];
-int accStates[MAX_STATES];
-int accepting; //0 means no, any positive number means yes and it started at the index of that number
-int state;
-Oram_Block row; //use this inside opOram and functions it calls
-Oram_Block block; //use this outside opOram
+//automata are allocated when a set is loaded, each padded to its own tier
+Packed_Dfa* dfaSet[MAX_PATTERNS]; //loaded automata, numDfas of them
+int numDfas = 0;
+int numPatterns = 0; //patterns over all loaded automata, numbered in load order
+int setVersion = 0; //bumped each time a set is loaded, so sessions opened on an older one can be refused
+Session sessions[MAX_SESSIONS];
+Cache_Entry cache[MAX_CACHED];
+size_t cacheBytes = 0; //held by all cached sets, at most CACHE_BUDGET
+uint64_t cacheClock = 0; //ticks on every cache hit, insert and use, for LRU
+int activeEntry = -1; //cache slot the loaded set belongs to, -1 if the loaded set owns its automata
+sgx_aes_gcm_128bit_key_t provisionKey;
+int haveProvisionKey = 0;
+Provision_State provision;
+uint8_t provisionStage[PROVISION_CHUNK]; //decrypted chunk; the only plaintext copy made of a provisioned set
+sgx_thread_mutex_t provisionMutex = SGX_THREAD_MUTEX_INITIALIZER; //held by each provisioning ecall over the key, provision and the stage
+sgx_thread_mutex_t sessionMutex = SGX_THREAD_MUTEX_INITIALIZER;
+int backendMode = DFA_BACKEND_AUTO; //set by setBackend, applied to each set as it is installed
+sgx_thread_mutex_t oramMutex = SGX_THREAD_MUTEX_INITIALIZER; //opOram rewrites the tree and stash, so row fetches through it take turns
+sgx_thread_mutex_t stateMutex = SGX_THREAD_MUTEX_INITIALIZER; //scans sharing the set read and leave the automata's runDFA states in turn
+Parallel_Job job = {NULL, {0}, 0, 0, 0, {0}, NULL, NULL, 0, 0, 0, 0, 0,
+    SGX_THREAD_MUTEX_INITIALIZER, SGX_THREAD_COND_INITIALIZER, SGX_THREAD_COND_INITIALIZER};
+Set_Lock setLock = {0, 0, 0, SGX_THREAD_MUTEX_INITIALIZER, SGX_THREAD_COND_INITIALIZER};
 
 
+#if !defined(DFA_UNTRUSTED) //Tests/dfatest builds this file untrusted, printing with the C library
 /* 
  * printf: 
  *   Invokes OCALL to display the enclave buffer to the terminal.
@@ -61,214 +77,1043 @@ void printf(const char *fmt, ...)
     va_end(ap);
     ocall_print_string(buf);
 }
+#endif
 
-int nextPowerOfTwo(unsigned int v){
-	v--;
-	v |= v >> 1;
-	v |= v >> 2;
-	v |= v >> 4;
-	v |= v >> 8;
-	v |= v >> 16;
-	v++;
-	return v;
-}
-
-
-int prepDFA(){ //our hard-coded regex: *D.?A.?R.?P.?A*
-    //NOTE: code from this function is for testing only! It would not provide security in a real enclave because the code is visible to outsiders. 
-    //  It would have to be loaded encrypted from outside
-
-    //set up accepting states
-    //for(int i = 0; i < 9; i++) accStates[i] = 0;
-    accStates[9] = 1;
-    //for(int i = 10; i < MAX_STATES; i++) accStates[i] = 0;
-    
-    //set up DFA outside of ORAM
-    //state 0
-    DFA[0].state = 1;
-    DFA[0].transition = 'D';
-    //for(int i = 0; i < 256; i++){DFA[i].state = 0; DFA[i] = 0;}
-    //state 1
-    DFA[256].state = 1;
-    DFA[256].transition = 'D';
-    DFA[256+1].state = 3;
-    DFA[256+1].transition = 'A';
-    DFA[256+2].state = 2;
-    DFA[256+2].transition = 0;
-    //for(int i = 256+3; i < 2*256; i++){DFA[i].state = 0; DFA[i].transition = 0;}
-    //state 2
-    DFA[2*256].state = 1;
-    DFA[2*256].transition = 'D';
-    DFA[2*256+1].state = 3;
-    DFA[2*256+1].transition = 'A';
-    //for(int i = 2*256+2; i < 3*256; i++){DFA[i].state = 0; DFA[i].transition = 0;}
-    //state 3
-    DFA[3*256].state = 1;
-    DFA[3*256].transition = 'D';
-    DFA[3*256+1].state = 5;
-    DFA[3*256+1].transition = 'R';
-    DFA[3*256+2].state = 4;
-    DFA[3*256+2].transition = 0;
-    //for(int i = 3*256+3; i < 4*256; i++){DFA[i].state = 0; DFA[i].transition = 0;}
-    //state 4
-    DFA[4*256].state = 1;
-    DFA[4*256].transition = 'D';
-    DFA[4*256+1].state = 5;
-    DFA[4*256+1].transition = 'R';
-    //for(int i = 4*256+2; i < 5*256; i++){DFA[i].state = 0; DFA[i].transition = 0;}
-    //state 5
-    DFA[5*256].state = 1;
-    DFA[5*256].transition = 'D';
-    DFA[5*256+1].state = 7;
-    DFA[5*256+1].transition = 'P';
-    DFA[5*256+2].state = 6;
-    DFA[5*256+2].transition = 0;
-    //for(int i = 5*256+3; i < 6*256; i++){DFA[i].state = 0; DFA[i].transition = 0;}
-    //state 6
-    DFA[6*256].state = 1;
-    DFA[6*256].transition = 'D';
-    DFA[6*256+1].state = 7;
-    DFA[6*256+1].transition = 'P';
-    //for(int i = 6*256+2; i < 7*256; i++){DFA[i].state = 0; DFA[i].transition = 0;}
-    //state 7
-    DFA[7*256].state = 1;
-    DFA[7*256].transition = 'D';
-    DFA[7*256+1].state = 9;
-    DFA[7*256+1].transition = 'A';
-    DFA[7*256+2].state = 8;
-    DFA[7*256+2].transition = 0;
-    //for(int i = 7*256+3; i < 8*256; i++){DFA[i].state = 0; DFA[i].transition = 0;}
-    //state 8
-    DFA[8*256].state = 1;
-    DFA[8*256].transition = 'D';
-    DFA[8*256+1].state = 9;
-    DFA[8*256+1].transition = 'A';
-    //for(int i = 8*256+2; i < 9*256; i++){DFA[i].state = 0; DFA[i].transition = 0;}
-    //state 9
-    DFA[9*256].state = 9;
-    DFA[9*256].transition = 0;
-    //for(int i = 9*256+1; i < 10*256; i++){DFA[i].state = 0; DFA[i].transition = 0;}
-    //rest of space 
-    //for(int i = 10*256; i < 256*256; i++){DFA[i].state = 0; DFA[i].transition = 0;}
-    
+void selectRow(uint64_t* out, const uint64_t* table, int rows, int rowWords, int index){
+    //copy row index of table into out without branching or indexing on index
+    //every row is read in full and in order, and or-ed into out under a mask that is all ones only for row index
+    memset(out, 0, rowWords*sizeof(uint64_t));
+    for(int i = 0; i < rows; i++){
+        condOr(out, table + (size_t)i*rowWords, rowWords, ctMask(i == index));
+    }
+}
+
+
+void selectRows(uint64_t* out, const uint64_t* table, int rows, int rowWords, const int* index, int count){
+    //selectRow for count indices at once: out holds count rows, out row k gets table row index[k]
+    //each table row is loaded once and folded into every output while it is in registers, so one
+    //pass over the table serves all count picks. count is public, the indices are not
+    int vecWords = rowWords - rowWords % VEC_WORDS;
+    uint64_t masks[MAX_BATCH];
+    memset(out, 0, count*rowWords*sizeof(uint64_t));
+    for(int i = 0; i < rows; i++){
+        const uint64_t* src = table + (size_t)i*rowWords;
+        for(int k = 0; k < count; k++){
+            masks[k] = ctMask(i == index[k]);
+        }
+        for(int j = 0; j < vecWords; j += VEC_WORDS){
+            Vec v;
+            __builtin_memcpy(&v, src+j, sizeof(Vec)); //unaligned loads, rows need not start on a vector boundary
+            for(int k = 0; k < count; k++){
+                Vec acc;
+                __builtin_memcpy(&acc, out+k*rowWords+j, sizeof(Vec));
+                acc |= v & masks[k];
+                __builtin_memcpy(out+k*rowWords+j, &acc, sizeof(Vec));
+            }
+        }
+        for(int j = vecWords; j < rowWords; j++){
+            for(int k = 0; k < count; k++){
+                out[k*rowWords+j] |= src[j] & masks[k];
+            }
+        }
+    }
+}
+
+
+void lockSet(int exclusive){
+    //every ecall that reads the loaded set holds it shared, every one that frees, replaces or rebuilds its automata
+    //or their ORAMs holds it exclusively, so a host making ecalls from several TCSs cannot free an automaton under
+    //a scan. New readers wait behind a waiting writer, so a steady stream of hotcall scans cannot hold a new set off
+    //for ever; that means a thread must not take the lock again while it holds it. The threads lent to
+    //runDFAParallel take none and work under their caller's hold
+    sgx_thread_mutex_lock(&setLock.mutex);
+    if(exclusive){
+        setLock.writers++;
+        while(setLock.writing || setLock.readers > 0) sgx_thread_cond_wait(&setLock.released, &setLock.mutex);
+        setLock.writers--;
+        setLock.writing = 1;
+    }
+    else{
+        while(setLock.writing || setLock.writers > 0) sgx_thread_cond_wait(&setLock.released, &setLock.mutex);
+        setLock.readers++;
+    }
+    sgx_thread_mutex_unlock(&setLock.mutex);
+}
+
+void unlockSet(int exclusive){
+    sgx_thread_mutex_lock(&setLock.mutex);
+    if(exclusive) setLock.writing = 0;
+    else setLock.readers--;
+    if(setLock.readers == 0) sgx_thread_cond_broadcast(&setLock.released);
+    sgx_thread_mutex_unlock(&setLock.mutex);
+}
+
+void installDFASet(Packed_Dfa** packed, int count){
+    //drop the loaded set (freeing it unless the cache owns it) and make the count packed automata the new one,
+    //numbering their patterns in order. The caller holds the set lock exclusively
+    if(activeEntry == -1){
+        for(int d = 0; d < numDfas; d++) freeDFA(dfaSet[d]);
+    }
+    activeEntry = -1;
+    numDfas = 0;
+    numPatterns = 0;
+    setVersion++;
+    for(int d = 0; d < count; d++){
+        packed[d]->firstPattern = numPatterns;
+        numPatterns += packed[d]->acceptBits;
+        dfaSet[numDfas++] = packed[d];
+        chooseBackend(packed[d]);
+    }
+}
+
+int loadDFASet(Staged_Dfa* dfas, int count){
+    //replace the loaded set with count shrunk staged automata, freeing their staging tables (see packDFASet)
+    //returns the number of automata, or -1 with the loaded set left as it was
+    Packed_Dfa* packed[MAX_PATTERNS];
+    int num = packDFASet(dfas, count, packed);
+    if(num >= 0) installDFASet(packed, num);
+    return num;
+}
+
+int getTier(){
+    int tier = 0;
+    lockSet(0);
+    for(int d = 0; d < numDfas; d++){
+        if(dfaSet[d]->numStates > tier) tier = dfaSet[d]->numStates;
+    }
+    unlockSet(0);
+    return tier;
+}
+
+int prepDFA(){ //our default regex: *D.?A.?R.?P.?A*
+    //NOTE: a pattern in the enclave code is for testing only! It would not provide security in a real enclave because the code is visible to outsiders.
+    //  It would have to be loaded encrypted from outside, see beginProvision
+    return prepDFASet("D.?A.?R.?P.?A") < 0 ? -1 : 0;
+}
+
+int prepDFASet(const char* patterns){
+    //compile one regex per line (see Regex.cpp) into the new set; runDFAMulti reports pattern p in accLocs[p]
+    //NOTE: like prepDFA this is for testing, the patterns are passed in the clear
+    //returns the number of patterns, DFA_TOO_LARGE if one needs more states than the compiler allows, or -1 if one is
+    //malformed, there are more than MAX_PATTERNS or memory runs out; the loaded set is then left as it was
+    Staged_Dfa dfas[MAX_PATTERNS];
+    int count = stagePatterns(patterns, dfas);
+    if(count < 0) return count;
+    lockSet(1);
+    int ret = loadDFASet(dfas, count) < 0 ? -1 : numPatterns;
+    unlockSet(1);
+    return ret;
+}
+
+int loadDFAImage(const uint8_t* image, size_t length){
+    //replace the loaded set with one compiled ahead of time by dfac (image layout in user_types.h). The image stays in
+    //untrusted memory and is read once, front to back: each table is copied straight into the allocation it runs from
+    //and hashed from there, so the host changing the image mid-load can only make the hash check fail
+    //the hash guards against corrupt or mismatched images, not a malicious host, which could rehash its own tables
+    //returns the number of patterns, or -1 with the loaded set left as it was if the image is malformed, its hash is
+    //wrong or memory runs out
+    dfa_image_header_t header;
+    dfa_image_entry_t entry;
+    Packed_Dfa* packed[MAX_PATTERNS];
+    sgx_sha_state_handle_t sha = NULL;
+    sgx_sha256_hash_t expected, hash;
+    size_t off = sizeof(header);
+    int count = 0, patterns = 0, ret = 0;
+    if(!image || length < sizeof(header) || !sgx_is_outside_enclave(image, length)) return -1;
+    memcpy(&header, image, sizeof(header));
+    if(header.magic != DFA_IMAGE_MAGIC || header.version != DFA_IMAGE_VERSION || header.size != length
+        || header.numDfas < 1 || header.numDfas > MAX_PATTERNS || sgx_sha256_init(&sha) != SGX_SUCCESS) return -1;
+    memcpy(expected, header.hash, sizeof(expected));
+    memset(header.hash, 0, sizeof(header.hash)); //the hash covers the header with this field zeroed
+    if(sgx_sha256_update((const uint8_t*)&header, sizeof(header), sha) != SGX_SUCCESS) ret = -1;
+
+    while(ret == 0 && count < (int)header.numDfas){
+        if(length-off < sizeof(entry)){
+            ret = -1;
+            break;
+        }
+        memcpy(&entry, image+off, sizeof(entry));
+        off += sizeof(entry);
+        Packed_Dfa* dfa = entryDFA(&entry);
+        if(!dfa){
+            ret = -1;
+            break;
+        }
+        packed[count++] = dfa;
+        size_t bytes = (size_t)dfa->numStates*dfa->rowWords*sizeof(uint64_t);
+        if(length-off < bytes){
+            ret = -1;
+            break;
+        }
+        memcpy(dfa->table, image+off, bytes);
+        off += bytes;
+        patterns += dfa->acceptBits;
+        if(sgx_sha256_update((const uint8_t*)&entry, sizeof(entry), sha) != SGX_SUCCESS
+            || sgx_sha256_update((const uint8_t*)dfa->table, bytes, sha) != SGX_SUCCESS) ret = -1;
+    }
+    if(ret == 0 && (off != length || patterns != (int)header.numPatterns || patterns > MAX_PATTERNS
+        || sgx_sha256_get_hash(sha, &hash) != SGX_SUCCESS || memcmp(hash, expected, sizeof(hash)) != 0)){
+        ret = -1;
+    }
+    sgx_sha256_close(sha);
+    if(ret != 0){
+        printf("rejected DFA image after %d of %u automata\n", count, header.numDfas);
+        for(int d = 0; d < count; d++) freeDFA(packed[d]);
+        return -1;
+    }
+    lockSet(1);
+    installDFASet(packed, count);
+    ret = numPatterns;
+    unlockSet(1);
+    return ret;
+}
+
+int dfaParts(Packed_Dfa* dfa, uint8_t** parts, size_t* sizes){
+    //the memory of an automaton with its ORAM set up, as sealDFASet saves it: table, position map, stash, tree and
+    //Ring ORAM bucket metadata, empty for the other schemes (the stashes, trees and metadata of all the ORAM's
+    //levels are each one allocation, see allocOram)
+    Path_Oram* last = &dfa->oram;
+    size_t nodes = 0;
+    int levels = 0;
+    for(Path_Oram* level = &dfa->oram; level; level = level->posOram){
+        nodes += level->nodes;
+        levels++;
+        last = level;
+    }
+    parts[0] = (uint8_t*)dfa->table;
+    sizes[0] = (size_t)dfa->numStates*dfa->rowWords*sizeof(uint64_t);
+    parts[1] = (uint8_t*)last->posMap;
+    sizes[1] = last->numBlocks*sizeof(unsigned int);
+    parts[2] = (uint8_t*)dfa->oram.stash;
+    sizes[2] = levels*2*STASH_SPACE*sizeof(Oram_Block);
+    parts[3] = (uint8_t*)dfa->oram.buckets;
+    sizes[3] = nodes*bucketSlots(dfa->oram.scheme)*sizeof(Oram_Block);
+    parts[4] = (uint8_t*)dfa->oram.meta;
+    sizes[4] = dfa->oram.meta ? nodes*sizeof(Ring_Meta) : 0;
+    return SEAL_PARTS;
+}
+
+int sealRecords(Packed_Dfa** dfas, int count){
+    //records sealDFASet writes for a set: the header, then each part of each automaton in SEAL_CHUNK pieces
+    int records = 1;
+    for(int d = 0; d < count; d++){
+        uint8_t* parts[SEAL_PARTS];
+        size_t sizes[SEAL_PARTS];
+        dfaParts(dfas[d], parts, sizes);
+        for(int k = 0; k < SEAL_PARTS; k++) records += (sizes[k]+SEAL_CHUNK-1)/SEAL_CHUNK;
+    }
+    return records;
+}
+
+int sealRecord(Seal_Aad* aad, const uint8_t* data, uint32_t size, sgx_sealed_data_t* sealed){
+    //seal size bytes of data with aad as its MAC text and pass the record to the App; aad->index is its place in the set
+    sgx_attributes_t mask;
+    int saved = -1;
+    mask.flags = SEAL_FLAGS_MASK;
+    mask.xfrm = 0;
+    uint32_t bytes = sgx_calc_sealed_data_size(sizeof(*aad), size);
+    if(sgx_seal_data_ex(SGX_KEYPOLICY_MRENCLAVE, mask, SEAL_MISC_MASK, sizeof(*aad), (const uint8_t*)aad,
+        size, data, bytes, sealed) != SGX_SUCCESS) return -1;
+    if(ocall_save_sealed(&saved, (const uint8_t*)sealed, bytes, aad->index) != SGX_SUCCESS || saved != 0) return -1;
+    return 0;
+}
+
+int sealDFASet(){
+    //seal the loaded set, ORAMs included, to this enclave build (MRENCLAVE, since the records follow its struct
+    //layout) and hand it to the App through ocall_save_sealed, one record at a time. Each record seals at most
+    //SEAL_CHUNK bytes straight from the structure it covers and carries a Seal_Aad tying it to its place in this set
+    //scans move blocks between the stashes and trees as they fetch rows, so the set is held exclusively until the
+    //last record is out; under a shared hold a block could be sealed in both a bucket and the stash, or in neither
+    //returns the number of records, or -1 if no set is loaded, initDFA has not run, or sealing or saving fails
+    Seal_Header header;
+    Seal_Aad aad;
+    lockSet(1);
+    int ret = (numDfas == 0) ? -1 : 0;
+    for(int d = 0; d < numDfas; d++){
+        if(!dfaSet[d]->oram.buckets) ret = -1;
+    }
+    if(ret != 0){
+        unlockSet(1);
+        return -1;
+    }
+    memset(&header, 0, sizeof(header));
+    memset(&aad, 0, sizeof(aad));
+    header.numDfas = numDfas;
+    for(int d = 0; d < numDfas; d++){
+        header.schemes[d] = dfaSet[d]->oram.scheme;
+        int l = 0;
+        for(Path_Oram* level = &dfaSet[d]->oram; level; level = level->posOram, l++){
+            header.evictions[d][l] = level->evictions;
+            header.accesses[d][l] = level->accesses;
+        }
+        dfaEntry(dfaSet[d], &header.entries[d]);
+    }
+    aad.version = SEAL_VERSION;
+    aad.count = sealRecords(dfaSet, numDfas);
+    sgx_sealed_data_t* sealed = (sgx_sealed_data_t*)malloc(sgx_calc_sealed_data_size(sizeof(aad), SEAL_CHUNK));
+    if(!sealed || sgx_read_rand(aad.setId, sizeof(aad.setId)) != SGX_SUCCESS){
+        unlockSet(1);
+        free(sealed);
+        return -1;
+    }
+
+    aad.index = 0;
+    ret = sealRecord(&aad, (const uint8_t*)&header, offsetof(Seal_Header, entries)+numDfas*sizeof(dfa_image_entry_t), sealed);
+    for(int d = 0; d < numDfas && ret == 0; d++){
+        uint8_t* parts[SEAL_PARTS];
+        size_t sizes[SEAL_PARTS];
+        dfaParts(dfaSet[d], parts, sizes);
+        for(int k = 0; k < SEAL_PARTS && ret == 0; k++){
+            for(size_t off = 0; off < sizes[k] && ret == 0; off += SEAL_CHUNK){
+                aad.index++;
+                ret = sealRecord(&aad, parts[k]+off, (sizes[k]-off < SEAL_CHUNK) ? sizes[k]-off : SEAL_CHUNK, sealed);
+            }
+        }
+    }
+    unlockSet(1);
+    free(sealed);
+    return ret != 0 ? -1 : (int)aad.count;
+}
+
+int unsealRecord(const uint8_t* blob, size_t length, size_t* off, sgx_sealed_data_t* stage, Seal_Aad* aad,
+    uint8_t* out, uint32_t size){
+    //take the next record (a uint32 length, then the sealed bytes) from the App's blob at *off, copy it into stage
+    //and unseal it into out, which has room for size bytes, and its MAC text into aad
+    //returns the number of bytes unsealed, or -1 if the record is cut short, malformed or fails to unseal
+    uint32_t bytes, aadSize = sizeof(*aad), got = size;
+    if(length-*off < sizeof(bytes)) return -1;
+    memcpy(&bytes, blob+*off, sizeof(bytes));
+    if(bytes > sgx_calc_sealed_data_size(sizeof(*aad), SEAL_CHUNK) || length-*off-sizeof(bytes) < bytes) return -1;
+    memcpy(stage, blob+*off+sizeof(bytes), bytes);
+    *off += sizeof(bytes)+bytes;
+    //the sizes inside the record must describe exactly the bytes copied, or unsealing would read past them
+    uint32_t macSize = sgx_get_add_mac_txt_len(stage), textSize = sgx_get_encrypt_txt_len(stage);
+    if(macSize != sizeof(*aad) || textSize > size || sgx_calc_sealed_data_size(macSize, textSize) != bytes) return -1;
+    if(sgx_unseal_data(stage, (uint8_t*)aad, &aadSize, out, &got) != SGX_SUCCESS || aad->version != SEAL_VERSION) return -1;
+    return got;
+}
+
+int unsealDFASet(const uint8_t* blob, size_t length){
+    //restore a set written by sealDFASet from the App's copy of its records, stored back to back as
+    //ocall_save_sealed received them. Each record is copied in and unsealed straight into the allocation it
+    //belongs to, so there is no compiling, no initDFA and no second copy of the set. The records must all come
+    //from one sealDFASet call, complete and in order
+    //NOTE: sealing cannot stop the host replaying an older blob; the ORAMs then reuse position maps they had
+    //before, which can link queries made after each restore. Run initDFA after restoring if that matters
+    //returns the number of patterns, or -1 with the loaded set left as it was
+    Seal_Header header;
+    Seal_Aad first, aad;
+    Packed_Dfa* packed[MAX_PATTERNS];
+    size_t off = 0;
+    int count = 0, ret = 0;
+    sgx_sealed_data_t* stage = NULL;
+    if(blob && sgx_is_outside_enclave(blob, length)){
+        stage = (sgx_sealed_data_t*)malloc(sgx_calc_sealed_data_size(sizeof(Seal_Aad), SEAL_CHUNK));
+    }
+    if(!stage) return -1;
+
+    //the header record gives the set id, record count and shape of each automaton
+    int got = unsealRecord(blob, length, &off, stage, &first, (uint8_t*)&header, sizeof(header));
+    if(got < (int)offsetof(Seal_Header, entries) || first.index != 0 || header.numDfas < 1 || header.numDfas > MAX_PATTERNS
+        || got != (int)(offsetof(Seal_Header, entries)+header.numDfas*sizeof(dfa_image_entry_t))) ret = -1;
+    for(int d = 0; ret == 0 && d < (int)header.numDfas; d++){
+        packed[count] = entryDFA(&header.entries[d]);
+        if(!packed[count] || header.schemes[d] > ORAM_RING) ret = -1;
+        if(packed[count]) packed[count]->oram.scheme = header.schemes[d];
+        if(packed[count] && allocOram(packed[count++]) != 0) ret = -1;
+    }
+    for(int d = 0; ret == 0 && d < count; d++){ //the counters pick the next Circuit and Ring ORAM eviction paths
+        int l = 0;
+        for(Path_Oram* level = &packed[d]->oram; level; level = level->posOram, l++){
+            level->evictions = header.evictions[d][l];
+            level->accesses = header.accesses[d][l];
+        }
+    }
+    if(ret == 0 && sealRecords(packed, count) != (int)first.count) ret = -1;
+
+    //then every part in order, each piece unsealed in place
+    uint32_t index = 0;
+    for(int d = 0; d < count && ret == 0; d++){
+        uint8_t* parts[SEAL_PARTS];
+        size_t sizes[SEAL_PARTS];
+        dfaParts(packed[d], parts, sizes);
+        for(int k = 0; k < SEAL_PARTS && ret == 0; k++){
+            for(size_t at = 0; at < sizes[k] && ret == 0; at += SEAL_CHUNK){
+                uint32_t n = (sizes[k]-at < SEAL_CHUNK) ? sizes[k]-at : SEAL_CHUNK;
+                index++;
+                got = unsealRecord(blob, length, &off, stage, &aad, parts[k]+at, n);
+                if(got != (int)n || aad.index != index || aad.count != first.count
+                    || memcmp(aad.setId, first.setId, sizeof(aad.setId)) != 0) ret = -1;
+            }
+        }
+    }
+    if(ret == 0 && off != length) ret = -1;
+    free(stage);
+    if(ret != 0){
+        for(int d = 0; d < count; d++) freeDFA(packed[d]);
+        return -1;
+    }
+    lockSet(1);
+    installDFASet(packed, count);
+    ret = numPatterns;
+    unlockSet(1);
+    return ret;
+}
+
+int setProvisionKey(const uint8_t* key){
+    //NOTE: for testing, like prepDFA. In a deployment the key would come from a remote attestation key exchange
+    //(e.g. sgx_ra_get_keys) and never be seen by the App
+    sgx_thread_mutex_lock(&provisionMutex);
+    memcpy(provisionKey, key, sizeof(provisionKey));
+    haveProvisionKey = 1;
+    sgx_thread_mutex_unlock(&provisionMutex);
+    return 0;
+}
+
+int beginProvision(const uint8_t* nonce){
+    //start receiving an encrypted set (format in user_types.h), dropping any half-provisioned one
+    //the loaded set keeps running until the last chunk has arrived and checked out. Returns 0, or -1 without a key
+    //there is one stream at a time: provisioning ecalls take turns on provisionMutex, so a chunk arriving on
+    //another TCS waits for the one in hand rather than interleaving with it or freeing its automata
+    sgx_thread_mutex_lock(&provisionMutex);
+    dropProvision();
+    int ret = haveProvisionKey ? 0 : -1;
+    if(ret == 0){
+        memcpy(provision.nonce, nonce, sizeof(provision.nonce));
+        provision.active = 1;
+    }
+    sgx_thread_mutex_unlock(&provisionMutex);
+    return ret;
+}
+
+void abortProvision(){
+    sgx_thread_mutex_lock(&provisionMutex);
+    dropProvision();
+    sgx_thread_mutex_unlock(&provisionMutex);
+}
+
+void dropProvision(){
+    for(int d = 0; d < provision.count; d++) freeDFA(provision.packed[d]);
+    memset(&provision, 0, sizeof(provision));
+}
+
+int provisionBytes(const uint8_t* data, uint32_t length){
+    //the image parser, fed decrypted bytes in whatever pieces the chunks cut them into. Headers and entries are
+    //gathered in provision.hold, table bytes go straight into the table they belong to. Returns 0, or -1 if the
+    //image is malformed or memory runs out
+    Provision_State* pv = &provision;
+    uint32_t at = 0;
+    while(at < length){
+        uint32_t n = length-at;
+        if(pv->phase == PROVISION_DONE) return -1; //bytes past the last table
+        if(pv->phase == PROVISION_TABLE){
+            Packed_Dfa* dfa = pv->packed[pv->count-1];
+            size_t bytes = (size_t)dfa->numStates*dfa->rowWords*sizeof(uint64_t);
+            if(n > bytes-pv->tableOff) n = bytes-pv->tableOff;
+            memcpy((uint8_t*)dfa->table+pv->tableOff, data+at, n);
+            pv->tableOff += n;
+            if(pv->tableOff == bytes) pv->phase = (pv->count == (int)pv->header.numDfas) ? PROVISION_DONE : PROVISION_ENTRY;
+        }
+        else{
+            uint32_t want = (pv->phase == PROVISION_HEADER) ? sizeof(dfa_image_header_t) : sizeof(dfa_image_entry_t);
+            if(n > want-pv->held) n = want-pv->held;
+            memcpy(pv->hold+pv->held, data+at, n);
+            pv->held += n;
+            if(pv->held == want && pv->phase == PROVISION_HEADER){
+                memcpy(&pv->header, pv->hold, sizeof(pv->header));
+                if(pv->header.magic != DFA_IMAGE_MAGIC || pv->header.version != DFA_IMAGE_VERSION
+                    || pv->header.numDfas < 1 || pv->header.numDfas > MAX_PATTERNS) return -1;
+                pv->phase = PROVISION_ENTRY;
+                pv->held = 0;
+            }
+            else if(pv->held == want){
+                Packed_Dfa* dfa = entryDFA((const dfa_image_entry_t*)pv->hold);
+                if(!dfa) return -1;
+                pv->packed[pv->count++] = dfa;
+                pv->patterns += dfa->acceptBits;
+                pv->phase = PROVISION_TABLE;
+                pv->tableOff = 0;
+                pv->held = 0;
+            }
+        }
+        at += n;
+    }
+    pv->received += length;
     return 0;
 }
 
-int initDFA(){ //initialize or reset DFA and ORAM
+int provisionChunk(const uint8_t* chunk, uint32_t length, const uint8_t* mac, int last){
+    //authenticate and decrypt the next chunk of the set begun with beginProvision into provisionStage, then parse it
+    //into the automata's tables, so provisioning memory is the set itself plus one chunk however large the set is
+    //the set replaces the loaded one when the last chunk completes it, with the ORAMs installDFASet builds for the
+    //backend in use; provisioning does not run initDFA. Returns the number of patterns after the last chunk, 0
+    //after any other, or -1 if no set is being provisioned or the chunk is out of order, fails to authenticate or
+    //does not parse; the stream is dropped then and the loaded set left as it was
+    uint8_t iv[12];
+    uint32_t aad = last ? 1 : 0;
+    sgx_thread_mutex_lock(&provisionMutex);
+    if(!provision.active || length > PROVISION_CHUNK){
+        dropProvision();
+        sgx_thread_mutex_unlock(&provisionMutex);
+        return -1;
+    }
+    memcpy(iv, provision.nonce, sizeof(provision.nonce));
+    memcpy(iv+sizeof(provision.nonce), &provision.index, sizeof(provision.index));
+    provision.index++;
+    if(sgx_rijndael128GCM_decrypt(&provisionKey, chunk, length, provisionStage, iv, sizeof(iv),
+        (const uint8_t*)&aad, sizeof(aad), (const sgx_aes_gcm_128bit_tag_t*)mac) != SGX_SUCCESS
+        || provisionBytes(provisionStage, length) != 0){
+        memset(provisionStage, 0, length);
+        dropProvision();
+        sgx_thread_mutex_unlock(&provisionMutex);
+        return -1;
+    }
+    memset(provisionStage, 0, length);
+    if(!last){
+        sgx_thread_mutex_unlock(&provisionMutex);
+        return 0;
+    }
+
+    if(provision.phase != PROVISION_DONE || provision.received != provision.header.size
+        || provision.patterns != (int)provision.header.numPatterns || provision.patterns > MAX_PATTERNS){
+        dropProvision();
+        sgx_thread_mutex_unlock(&provisionMutex);
+        return -1;
+    }
+    lockSet(1);
+    installDFASet(provision.packed, provision.count);
+    int patterns = numPatterns;
+    unlockSet(1);
+    memset(&provision, 0, sizeof(provision)); //the automata belong to the loaded set now
+    sgx_thread_mutex_unlock(&provisionMutex);
+    return patterns;
+}
+
+size_t dfaBytes(const Packed_Dfa* dfa){
+    //memory a packed automaton holds: table, then if its ORAM is built the tree and stash of each level and the
+    //last level's position map. Both the level count and the slots a bucket has depend on the ORAM's scheme, so
+    //this is only right once initOram or chooseBackend has set it
+    size_t bytes = sizeof(Packed_Dfa) + (size_t)dfa->numStates*dfa->rowWords*sizeof(uint64_t);
+    if(!dfa->oram.buckets) return bytes;
+    int blocks[MAX_ORAM_LEVELS], nodes[MAX_ORAM_LEVELS];
+    int levels = oramShape(dfa->numStates, dfa->oram.scheme, blocks, nodes);
+    bytes += blocks[levels-1]*sizeof(unsigned int) + (levels-1)*sizeof(Path_Oram);
+    for(int l = 0; l < levels; l++){
+        bytes += nodes[l]*bucketSlots(dfa->oram.scheme)*sizeof(Oram_Block) + 2*STASH_SPACE*sizeof(Oram_Block);
+        if(dfa->oram.scheme == ORAM_RING) bytes += nodes[l]*sizeof(Ring_Meta);
+    }
+    return bytes;
+}
+
+int cacheFind(const uint8_t* digest){
+    //handle of the cached set compiled from the pattern text with this digest, marking it used, or -1
+    for(int i = 0; i < MAX_CACHED; i++){
+        if(cache[i].inUse && memcmp(cache[i].digest, digest, sizeof(cache[i].digest)) == 0){
+            cache[i].lastUse = ++cacheClock;
+            return cache[i].generation*MAX_CACHED + i;
+        }
+    }
+    return -1;
+}
+
+int cacheSlot(int handle){
+    //slot of a live handle, -1 if it was never issued or its set has been evicted since
+    if(handle < 0) return -1;
+    int slot = handle % MAX_CACHED;
+    if(!cache[slot].inUse || cache[slot].generation != handle / MAX_CACHED) return -1;
+    return slot;
+}
+
+int lruEntry(){
+    //least recently used cached set other than the loaded one, -1 if there is none
+    int lru = -1;
+    for(int i = 0; i < MAX_CACHED; i++){
+        if(cache[i].inUse && i != activeEntry && (lru == -1 || cache[i].lastUse < cache[lru].lastUse)) lru = i;
+    }
+    return lru;
+}
+
+void chargeEntry(int slot){
+    //recount what a cached set holds after chooseBackend has rebuilt its ORAMs, perhaps under another scheme,
+    //and evict least recently used sets until the cache is back within CACHE_BUDGET. The loaded set is never
+    //evicted, so it alone may still go over
+    Cache_Entry* e = &cache[slot];
+    cacheBytes -= e->bytes;
+    e->bytes = 0;
+    for(int d = 0; d < e->numDfas; d++) e->bytes += dfaBytes(e->dfas[d]);
+    cacheBytes += e->bytes;
+    int lru = lruEntry();
+    while(cacheBytes > CACHE_BUDGET && lru != -1){
+        evictEntry(lru);
+        lru = lruEntry();
+    }
+}
+
+void evictEntry(int slot){
+    Cache_Entry* e = &cache[slot];
+    for(int d = 0; d < e->numDfas; d++) freeDFA(e->dfas[d]);
+    cacheBytes -= e->bytes;
+    e->inUse = 0;
+}
+
+int cacheDFASet(const char* patterns){
+    //find the set compiled from patterns in the cache, or compile it, set up its ORAMs and add it, first evicting
+    //least recently used sets (never the loaded one) until it fits in CACHE_BUDGET and MAX_CACHED. A hit skips
+    //compilation and ORAM setup entirely. Entries are keyed by SHA-256 of the pattern text, so only identical
+    //pattern lists share one. Returns a handle for useDFASet, DFA_TOO_LARGE as prepDFASet does, or -1 if the patterns
+    //do not compile, the set does not fit even in an empty cache or memory runs out. The cache is only touched under
+    //the set lock; compiling is done outside it, so scans of the loaded set carry on meanwhile
+    sgx_sha256_hash_t digest;
+    Staged_Dfa staged[MAX_PATTERNS];
+    Packed_Dfa* packed[MAX_PATTERNS];
+    if(sgx_sha256_msg((const uint8_t*)patterns, strlen(patterns), &digest) != SGX_SUCCESS) return -1;
+    lockSet(1);
+    int handle = cacheFind(digest);
+    unlockSet(1);
+    if(handle != -1) return handle;
+
+    int count = stagePatterns(patterns, staged);
+    if(count < 0) return count;
+    int num = packDFASet(staged, count, packed);
+    if(num < 0) return -1;
     int ret = 0;
+    for(int d = 0; d < num && ret == 0; d++){
+        if(initOram(packed[d]) != 0) ret = -1;
+    }
+    size_t bytes = 0; //once initOram has picked each ORAM's scheme, which sets its size
+    for(int d = 0; d < num; d++) bytes += dfaBytes(packed[d]);
 
-    accepting = 0;
-    memset(posMap, 0, MAX_STATES*4);
-    memset(ORAM, 0, MAX_STATES*sizeof(Oram_Bucket));
-    memset(stash, 0, STASH_SPACE*sizeof(Oram_Block));
-    state = 0;
-    
-    //init oram
-    for(int i = 0; i < MAX_STATES; i++){
-        for(int j = 0; j < BUCKET_SIZE; j++) {
-            ORAM[i].blocks[j].actualAddr = -1; //-1 means dummy block
+    lockSet(1);
+    handle = cacheFind(digest); //another thread may have cached the same patterns meanwhile
+    int slot = -1;
+    if(handle != -1 || bytes > CACHE_BUDGET) ret = -1; //a set too large for the whole cache evicts nothing
+    while(slot == -1 && ret == 0){
+        int empty = -1, lru = lruEntry();
+        for(int i = 0; i < MAX_CACHED && empty == -1; i++){
+            if(!cache[i].inUse) empty = i;
         }
-        
-        ret += sgx_read_rand((uint8_t*)&posMap[i], sizeof(unsigned int));
-        posMap[i] = posMap[i] % (MAX_STATES/2+1);
+        if(empty != -1 && cacheBytes+bytes <= CACHE_BUDGET) slot = empty;
+        else if(lru != -1) evictEntry(lru);
+        else ret = -1;
     }
+    if(ret != 0){
+        unlockSet(1);
+        for(int d = 0; d < num; d++) freeDFA(packed[d]);
+        return handle;
+    }
+
+    Cache_Entry* e = &cache[slot];
+    e->inUse = 1;
+    e->generation = (e->generation+1) & 0xffffff; //keeps handles positive
+    memcpy(e->digest, digest, sizeof(digest));
+    memcpy(e->dfas, packed, num*sizeof(Packed_Dfa*));
+    e->numDfas = num;
+    e->bytes = bytes;
+    e->lastUse = ++cacheClock;
+    cacheBytes += bytes;
+    handle = e->generation*MAX_CACHED + slot;
+    unlockSet(1);
+    return handle;
+}
+
+int useDFASet(int handle){
+    //make a cached set the loaded one without rebuilding anything: its automata go back to their start states and
+    //their ORAMs carry on as they are. Sessions opened on the previous set are refused, as after prepDFASet
+    //returns the number of patterns, or -1 if the handle is stale (cache the patterns again to get a new one)
+    lockSet(1);
+    int slot = cacheSlot(handle), ret = -1;
+    if(slot != -1){
+        Cache_Entry* e = &cache[slot];
+        installDFASet(e->dfas, e->numDfas);
+        activeEntry = slot;
+        chargeEntry(slot); //installing ran chooseBackend, which may have rebuilt ORAMs for the current mode
+        for(int d = 0; d < numDfas; d++) dfaSet[d]->state = 0;
+        e->lastUse = ++cacheClock;
+        ret = numPatterns;
+    }
+    unlockSet(1);
+    return ret;
+}
+
+int64_t oramCost(int numBlocks, int blockSize, int scheme){
+    //picoseconds one access to an ORAM of numBlocks blocks takes, then the leaf has to be looked up and moved in
+    //the position map. Path ORAM offers every stash block to every slot of each bucket on the path, a masked copy
+    //of the block each time, which dominates; compacting the stash is a masked swap per slot and round.
+    //Circuit ORAM reads the path and its small stash once and evicts along two paths: per eviction it plans from
+    //each slot's leaf at every level and then reads and writes each slot about twice, see circuitAccess.
+    //Ring ORAM copies one block a bucket and scans the stash twice; a bucket is rewritten every RING_DUMMIES
+    //reads of it and a path every RING_EVICT_RATE accesses, the stash offered to each of its slots, see ringAccess
+    int depth = 0;
+    while((1 << depth) < numBlocks) depth++;
+    depth++; //the tree has 2*nextPowerOfTwo(numBlocks)-1 buckets
+    int64_t words = blockSize/sizeof(uint64_t);
+    if(scheme == ORAM_CIRCUIT){
+        int64_t slots = CIRCUIT_STASH + (int64_t)depth*BUCKET_SIZE;
+        return (5*slots+CIRCUIT_STASH)*words*CIRCUIT_WORD_COST + 2*slots*(depth+1)*CIRCUIT_SLOT_COST
+            + posMapCost(numBlocks, scheme);
+    }
+    int64_t swaps = 0;
+    for(int step = 1; step < 2*STASH_SPACE; step <<= 1) swaps += 2*STASH_SPACE-step;
+    int64_t compact = swaps*(words*COMPACT_WORD_COST + COMPACT_SWAP_COST);
+    if(scheme == ORAM_RING){
+        int64_t rewrite = 2*RING_SLOTS*BUCKET_SIZE; //copies to read and write one bucket
+        int64_t copies = 2*STASH_SPACE + depth + depth*rewrite/RING_DUMMIES
+            + depth*(rewrite + BUCKET_SIZE*STASH_SPACE)/RING_EVICT_RATE;
+        return copies*(words*RING_WORD_COST + RING_COPY_COST) + compact/RING_EVICT_RATE + posMapCost(numBlocks, scheme);
+    }
+    int64_t offered = (int64_t)depth*BUCKET_SIZE*STASH_SPACE;
+    return offered*(words*ORAM_WORD_COST + ORAM_SLOT_COST) + compact + posMapCost(numBlocks, scheme);
+}
+
+int64_t posMapCost(int numBlocks, int scheme){
+    //the cheaper of scanning a position map of numBlocks leaves and an access to the ORAM it would be packed into
+    int64_t scan = (int64_t)numBlocks*POSMAP_ENTRY_COST;
+    if(numBlocks <= POSMAP_FANOUT) return scan;
+    int64_t packed = oramCost((numBlocks+POSMAP_FANOUT-1)/POSMAP_FANOUT, POSMAP_BLOCK_SIZE, scheme);
+    return packed < scan ? packed : scan;
+}
+
+int recursePosMap(int numBlocks, int scheme){
+    //a scan costs under a ns a leaf. A Path ORAM access costs about 30 us even on a small tree, so its position
+    //map only moves into an ORAM from about 2^18 blocks; a Circuit ORAM access costs a few us, so its position
+    //map moves from 2^14 blocks, and a Ring ORAM one from 2^17. All of these are past the largest of STATE_TIERS,
+    //so as shipped every position map is scanned; building with POSMAP_FORCE_FROM set makes the recursive levels
+    //run on the tiers there are
+    if(POSMAP_FORCE_FROM > 0 && numBlocks > POSMAP_FORCE_FROM && numBlocks > POSMAP_FANOUT) return 1;
+    return numBlocks > POSMAP_FANOUT && posMapCost(numBlocks, scheme) < (int64_t)numBlocks*POSMAP_ENTRY_COST;
+}
+
+int oramShape(int numBlocks, int scheme, int* blocks, int* nodes){
+    //blocks[l] and nodes[l] of each level of an ORAM holding numBlocks blocks: level 0 holds them, and each
+    //level after it holds the position map of the one before, until one is small enough to scan
+    int levels = 0;
+    for(;;){
+        blocks[levels] = numBlocks;
+        nodes[levels] = 2*nextPowerOfTwo(numBlocks)-1; //one leaf per block, rounded up to a full tree
+        levels++;
+        if(levels == MAX_ORAM_LEVELS || !recursePosMap(numBlocks, scheme)) return levels;
+        numBlocks = (numBlocks+POSMAP_FANOUT-1)/POSMAP_FANOUT;
+    }
+}
+
+int bucketSlots(int scheme){
+    return (scheme == ORAM_RING) ? RING_SLOTS : BUCKET_SIZE;
+}
+
+int allocOram(Packed_Dfa* dfa){ //allocate one automaton's ORAM unless it has one already, contents left unset
+    //the levels oramShape lays out share one allocation for their trees, one for their stashes and under Ring ORAM
+    //one for their bucket metadata, level 0 first, so the automaton's oram points at each; the structs of the
+    //levels after it are one more
+    Path_Oram* oram = &dfa->oram;
+    int blocks[MAX_ORAM_LEVELS], nodes[MAX_ORAM_LEVELS];
+    int ring = (oram->scheme == ORAM_RING);
+    if(oram->buckets) return 0;
+    int levels = oramShape(dfa->numStates, oram->scheme, blocks, nodes);
+    size_t totalNodes = 0;
+    for(int l = 0; l < levels; l++) totalNodes += nodes[l];
+    if(nodes[0] > Oram_Tree<MAX_TREE_DEPTH>::nodes) return -1; //accessOram has no code for a deeper tree
+    Oram_Block* slots = (Oram_Block*)malloc(totalNodes*bucketSlots(oram->scheme)*sizeof(Oram_Block));
+    Oram_Block* stash = (Oram_Block*)malloc(levels*2*STASH_SPACE*sizeof(Oram_Block));
+    unsigned int* posMap = (unsigned int*)malloc(blocks[levels-1]*sizeof(unsigned int));
+    Ring_Meta* meta = ring ? (Ring_Meta*)malloc(totalNodes*sizeof(Ring_Meta)) : NULL;
+    Path_Oram* below = (levels > 1) ? (Path_Oram*)calloc(levels-1, sizeof(Path_Oram)) : NULL;
+    if(!slots || !stash || !posMap || (ring && !meta) || (levels > 1 && !below)){
+        free(slots); free(stash); free(posMap); free(meta); free(below);
+        return -1;
+    }
+    Path_Oram* level = oram;
+    for(int l = 0; l < levels; l++){
+        level->buckets = (Oram_Bucket*)slots;
+        level->stash = stash;
+        level->meta = meta;
+        level->nodes = nodes[l];
+        level->numBlocks = blocks[l];
+        level->depth = 1;
+        while((1 << (level->depth-1)) < nodes[l]/2+1) level->depth++;
+        if(l > 0) level->blockSize = POSMAP_BLOCK_SIZE; //level 0 has the row width newDFA set
+        level->posMap = (l == levels-1) ? posMap : NULL;
+        level->posOram = (l == levels-1) ? NULL : &below[l];
+        level->scheme = oram->scheme;
+        level->evictions = 0;
+        level->accesses = 0;
+        slots += (size_t)nodes[l]*bucketSlots(oram->scheme);
+        stash += 2*STASH_SPACE;
+        if(ring) meta += nodes[l];
+        level = level->posOram;
+    }
+    return 0;
+}
 
-        //set stash empty
+int resetOram(Path_Oram* oram){
+    //empty the tree and stash of one level and give each of its blocks a random leaf in its position map,
+    //which on a recursive level means resetting the level under it and writing the leaves in as its blocks
+    int ret = 0;
+    Oram_Block block;
+    int leaves = oram->nodes/2+1;
+    int slots = oram->nodes*bucketSlots(oram->scheme);
+    Oram_Block* blocks = (Oram_Block*)oram->buckets;
+    memset(blocks, 0, slots*sizeof(Oram_Block));
+    memset(oram->stash, 0, STASH_SPACE*sizeof(Oram_Block));
+    for(int i = 0; i < slots; i++){
+        blocks[i].actualAddr = -1; //-1 means dummy block
+    }
     for(int i = 0; i < 2*STASH_SPACE; i++){
-        stash[i].actualAddr = -1;
+        oram->stash[i].actualAddr = -1;
+    }
+    for(int i = 0; oram->meta && i < oram->nodes; i++){
+        for(int j = 0; j < RING_SLOTS; j++){
+            oram->meta[i].addr[j] = -1;
+            oram->meta[i].valid[j] = 1;
+        }
+        oram->meta[i].count = 0;
+    }
+    oram->evictions = 0;
+    oram->accesses = 0;
+    if(!oram->posOram){
+        for(int i = 0; i < oram->numBlocks; i++){
+            ret += sgx_read_rand((uint8_t*)&oram->posMap[i], sizeof(unsigned int));
+            oram->posMap[i] &= leaves-1; //leaves is a power of two; a mask, unlike a division, takes the same time for any leaf
+        }
+        return ret;
+    }
+    ret = resetOram(oram->posOram);
+    for(int c = 0; c < oram->posOram->numBlocks; c++){
+        unsigned int leaf[POSMAP_FANOUT];
+        memset(&block, 0, sizeof(block));
+        block.actualAddr = c;
+        ret += sgx_read_rand((uint8_t*)leaf, sizeof(leaf));
+        for(int j = 0; j < POSMAP_FANOUT; j++) leaf[j] &= leaves-1;
+        memcpy(block.transitions, leaf, sizeof(leaf));
+        opOram(oram->posOram, c, &block, 1);
+    }
+    return ret;
+}
+
+int initOram(Packed_Dfa* dfa){ //initialize or reset one automaton's ORAM and put it in its start state
+    //a new ORAM gets the scheme backendMode forces or else the cheapest one; a built one keeps its own
+    dfa->state = 0;
+    if(!dfa->oram.buckets){
+        int forced = (backendMode != DFA_BACKEND_AUTO && backendMode != DFA_BACKEND_SCAN);
+        dfa->oram.scheme = backendScheme(forced ? backendMode : cheapestBackend(dfa, DFA_BACKEND_ORAM));
     }
-    
+    return fillOram(dfa);
+}
+
+int fillOram(Packed_Dfa* dfa){ //reset one automaton's ORAM to hold its table, leaving its state alone
+    Oram_Block block;
+    Path_Oram* oram = &dfa->oram;
+    if(allocOram(dfa) != 0) return -1;
+    int ret = resetOram(oram);
+
     //read in DFA row by row and put in ORAM
-    for(int i = 0; i < MAX_STATES; i++){
+    for(int i = 0; i < dfa->numStates; i++){
         block.actualAddr = i;
-        memcpy(&(block.transitions), &DFA[i*256], 256*sizeof(Entry));
-        opOram(i, &block, 1);
+        memcpy(&(block.transitions), &dfa->table[i*dfa->rowWords], dfa->rowWords*sizeof(uint64_t));
+        opOram(oram, i, &block, 1);
+    }
+    return ret;
+}
+
+int initDFA(){ //initialize or reset the DFAs and their ORAMs
+    lockSet(1);
+    int ret = (numDfas == 0) ? -1 : 0; //-1 if no DFA is loaded
+    for(int d = 0; d < numDfas && ret != -1; d++){
+        int r = initOram(dfaSet[d]);
+        ret = (r == -1) ? -1 : ret+r;
+    }
+    unlockSet(1);
+    return ret;
+}
+
+int64_t rowCost(const Packed_Dfa* dfa, int backend){
+    //picoseconds to fetch one row of dfa, from its shape alone (tiers are public, so the choice leaks nothing).
+    //A scan reads the whole table, see oramCost for an ORAM access. The scan grows with numStates, an ORAM
+    //with its log. Path ORAM, with STASH_SPACE at 128, only overtakes the scan well past the largest tier; Circuit
+    //ORAM overtakes it on the largest tier at any row width, and on the 1024 tier once rows are about 25 words
+    //wide. Ring ORAM copies the fewest blocks an access but offers the stash to each slot it evicts to, so in
+    //enclave memory it stays about 3-5x Circuit ORAM
+    if(backend != DFA_BACKEND_SCAN) return oramCost(dfa->numStates, dfa->oram.blockSize, backendScheme(backend));
+    return (int64_t)dfa->numStates*(dfa->rowWords*SCAN_WORD_COST + SCAN_ROW_COST);
+}
+
+int backendScheme(int backend){
+    if(backend == DFA_BACKEND_CIRCUIT) return ORAM_CIRCUIT;
+    if(backend == DFA_BACKEND_RING) return ORAM_RING;
+    return ORAM_PATH;
+}
+
+int cheapestBackend(const Packed_Dfa* dfa, int first){
+    //DFA_BACKEND_SCAN as first weighs every backend, DFA_BACKEND_ORAM only the ORAMs
+    int best = first;
+    for(int backend = first+1; backend <= DFA_BACKEND_RING; backend++){
+        if(rowCost(dfa, backend) < rowCost(dfa, best)) best = backend;
     }
+    return best;
+}
+
+int chooseBackend(Packed_Dfa* dfa){
+    //pick the backend backendMode asks for, or under DFA_BACKEND_AUTO the one rowCost rates cheapest for this
+    //automaton's tier and row width. An ORAM the automaton lacks, or has under another scheme, is built here;
+    //if it cannot be, the scan is kept. Rebuilding frees the tree fetchRow reads, so the caller holds the set
+    //lock exclusively
+    int want = (backendMode == DFA_BACKEND_AUTO) ? cheapestBackend(dfa, DFA_BACKEND_SCAN) : backendMode;
+    dfa->backend = DFA_BACKEND_SCAN;
+    if(want == DFA_BACKEND_SCAN) return dfa->backend;
+    int scheme = backendScheme(want);
+    if(dfa->oram.buckets && dfa->oram.scheme != scheme) freeOram(&dfa->oram);
+    dfa->oram.scheme = scheme;
+    if(dfa->oram.buckets || fillOram(dfa) != -1) dfa->backend = want;
+    return dfa->backend;
+}
 
-    
+int setBackend(int mode){
+    //how rows are fetched from now on, for the loaded set and those installed after it: DFA_BACKEND_AUTO
+    //(the default) picks per automaton, DFA_BACKEND_SCAN, _ORAM, _CIRCUIT and _RING force one for all.
+    //Returns how many loaded automata fetch through ORAM, -1 for an unknown mode or if a forced ORAM could not be built
+    if(mode < DFA_BACKEND_AUTO || mode > DFA_BACKEND_RING) return -1;
+    lockSet(1);
+    backendMode = mode;
+    int onOram = 0;
+    for(int d = 0; d < numDfas; d++){
+        onOram += (chooseBackend(dfaSet[d]) != DFA_BACKEND_SCAN);
+    }
+    if(activeEntry != -1) chargeEntry(activeEntry);
+    int ret = (mode >= DFA_BACKEND_ORAM && onOram != numDfas) ? -1 : onOram;
+    unlockSet(1);
     return ret;
 }
 
-int opOram(int index, Oram_Block* block, int write){ //the actual oram ops
-    unsigned int newLeaf, targetLeaf = 0;
+void fetchRow(Packed_Dfa* dfa, int state, uint64_t* out){
+    //the one place opDFA and opDFABatch get a row from: every backend hides which row was taken
+    if(dfa->backend != DFA_BACKEND_SCAN){
+        Oram_Block block;
+        sgx_thread_mutex_lock(&oramMutex);
+        opOram(&dfa->oram, state, &block, 0);
+        sgx_thread_mutex_unlock(&oramMutex);
+        memcpy(out, block.transitions, dfa->rowWords*sizeof(uint64_t));
+    }
+    else{
+        selectRow(out, dfa->table, dfa->numStates, dfa->rowWords, state);
+    }
+}
+
+int opOram(Path_Oram* oram, int index, Oram_Block* block, int write){ //the actual oram ops
+    accessOram(oram, index, block, write, -1, 0);
+    return 0;
+}
+
+unsigned int remapOram(Path_Oram* oram, int index, unsigned int newLeaf){
+    //leaf block index is on, moving it to newLeaf. On the last level the position map is scanned in full; above
+    //it the leaf is slot index%POSMAP_FANOUT of block index/POSMAP_FANOUT of the next level, swapped in one access
+    if(oram->posOram){
+        Oram_Block block;
+        return accessOram(oram->posOram, index/POSMAP_FANOUT, &block, 0, index%POSMAP_FANOUT, newLeaf);
+    }
+    //linear scan over position map to select leaf where index lives and to replace it with new leaf
+    return exchangeUint(oram->posMap, oram->numBlocks, index, newLeaf, 1);
+}
+
+unsigned int accessOram(Path_Oram* oram, int index, Oram_Block* block, int write, int slot, unsigned int value){
+    //one access to one level: read block index into block (or insert block when write). On a position map level
+    //slot is the leaf wanted in that block; it is replaced by value and the old leaf returned, otherwise slot is -1
+    //the schemes may branch on write: only fillOram and resetOram write, filling a tree from the table whenever one
+    //is built (initDFA, chooseBackend under setBackend or a load), which is public, while scans only ever read
+    return accessDepth<MAX_TREE_DEPTH>(oram, index, block, write, slot, value);
+}
+
+template<> unsigned int accessDepth<0>(Path_Oram*, int, Oram_Block*, int, int, unsigned int){
+    return 0; //allocOram builds no tree this shallow
+}
+
+template<int Depth> unsigned int accessDepth(Path_Oram* oram, int index, Oram_Block* block, int write, int slot, unsigned int value){
+    //run the scheme compiled for the tree's depth, where every loop along a path has a fixed count and every
+    //bucket on it is a fixed shift of its leaf; the tree depths are public, as the tiers are
+    if(oram->depth < Depth) return accessDepth<Depth-1>(oram, index, block, write, slot, value);
+    if(oram->scheme == ORAM_CIRCUIT) return circuitAccess<Depth>(oram, index, block, write, slot, value);
+    if(oram->scheme == ORAM_RING) return ringAccess<Depth>(oram, index, block, write, slot, value);
+    return pathAccess<Depth>(oram, index, block, write, slot, value);
+}
+
+unsigned int swapLeaf(Oram_Block* block, int match, int slot, unsigned int value){
+    //if match is 1, put value in leaf slot of a position map block and return what was there; every slot is visited
+    return exchangeUint(block->transitions, POSMAP_FANOUT, slot, value, match);
+}
+
+template<int Depth> unsigned int pathAccess(Path_Oram* oram, int index, Oram_Block* block, int write, int slot, unsigned int value){
+    //accessOram for ORAM_PATH
+    typedef Oram_Tree<Depth> Tree;
+    Oram_Bucket* ORAM = oram->buckets;
+    Oram_Block* stash = oram->stash;
+    int oramBlockSize = oram->blockSize;
+    int words = oramBlockSize/sizeof(uint64_t); //actualAddr and leaf fill the first word, rows are whole words
+    unsigned int newLeaf, targetLeaf, oldValue = 0;
     int match = 0;
+    Oram_Block row; //the block being read, local so ORAMs of different automata can be used at once
     sgx_read_rand((uint8_t*)&newLeaf, sizeof(unsigned int));
-    newLeaf = newLeaf % (MAX_STATES/2+1);
-    //linear scan over position map to select leaf where index lives and to replace it with new leaf
-    for(int i = 0; i < MAX_STATES; i++){
-        match = (index == i);
-        targetLeaf += match*posMap[i];
-        posMap[i] = match*newLeaf + (1-match)*posMap[i];
-    }
+    newLeaf = newLeaf % Tree::leaves;
+    targetLeaf = remapOram(oram, index, newLeaf);
     //read in a path down the tree
-    int nodeNumber = MAX_STATES/2+targetLeaf;
+    int nodeNumber = Tree::leaves-1+targetLeaf;
     int stashIndex = 0;
-    for(int i = (int)log2(MAX_STATES+1.1)-1; i>=0; i--){//bucket at depth i on path to leaf
+    for(int i = Depth-1; i>=0; i--){//bucket at depth i on path to leaf
         for(int j = 0; j < BUCKET_SIZE; j++){//for each block in bucket
             //put block in stash, clear it from ORAM
-            memcpy(&stash[stashIndex], &ORAM[nodeNumber].blocks[j], sizeof(Oram_Block));
+            memcpy(&stash[stashIndex], &ORAM[nodeNumber].blocks[j], oramBlockSize);
             stashIndex++;
             ORAM[nodeNumber].blocks[j].actualAddr = -1;//empty spot where the block was before
         }
         nodeNumber = (nodeNumber-1)/2;
     }
-    
-    //sort entire stash of size 2*STASH_SPACE so we can ignore second half
-    sortStash(0,2*STASH_SPACE, 0);
-    
+
+    //compact entire stash of size 2*STASH_SPACE so we can ignore second half
+    compactStash(oram);
+
     //scan stash for block to return
     //NOTE: only handling reads, see below for writes
-    //  and explanation. This would have to be changed for 
+    //  and explanation. This would have to be changed for
     //  full, general ORAM
     int foundItFlag = 0;
     stashIndex = 0;
     memset(&row, 0, sizeof(Oram_Block));
     for(int i = 0; i < STASH_SPACE; i++){
         stashIndex += (stash[i].actualAddr != -1); //add one to count of things in stash if this is a real block
-        //printf("%d ", stashIndex);
         //put this block in variable row if it is meant to be returned
         match = (stash[i].actualAddr == index);
-                //if(match) printf("MATCH");//printf("MATCH %d %d %d |", row.actualAddr,((uint8_t*)&row)[0], ((uint8_t*)(&stash[i]))[0] );
-
-        stash[i].leaf = match*newLeaf + (1-match)*stash[i].leaf;
-        for(int j = 0; j < sizeof(Oram_Block); j++){
-            ((uint8_t*)&row)[j] += (match * ((uint8_t*)(&stash[i]))[j]);
+        stash[i].leaf = selectInt(match, newLeaf, stash[i].leaf);
+        if(slot != -1){ //public: only position map levels pass a slot
+            oldValue |= swapLeaf(&stash[i], match, slot, value);
         }
+        condOr(&row, &stash[i], words, ctMask(match));
     }
-    
+
     //handle case where the block is not found
     //ok to leak this branch, it will only happen during writes
     //and writes will only happen while loading in the DFA
     //and it will happen once to a new node for each entry
     //NOTE: a general solution would have to hide this branch
-    //and also handle what happens if there's a read to a 
+    //and also handle what happens if there's a read to a
     //block that has not been touched before (I only handle the case for writes here)
     if(foundItFlag == 0 && write){
-        memcpy(&stash[stashIndex], block, sizeof(Oram_Block));
+        memcpy(&stash[stashIndex], block, oramBlockSize);
         stash[stashIndex].actualAddr = index; //may be redundant
         stash[stashIndex].leaf = newLeaf;
         stashIndex++;
-        //printf("inserted at stash index %d\n", stashIndex);
     }
     else{
-        memcpy(block, &row, sizeof(Oram_Block));
+        memcpy(block, &row, oramBlockSize);
     }
-    
+
     //write back path
-    nodeNumber = MAX_STATES/2+targetLeaf;
-    for(int i = (int)log2(MAX_STATES+1.1)-1; i>=0; i--){
-        int div = pow((double)2, ((int)log2(MAX_STATES+1.1)-1)-i);
+    nodeNumber = Tree::leaves-1+targetLeaf;
+    for(int i = Depth-1; i>=0; i--){
+        int shift = Depth-1-i; //levels below this bucket: a block may go here if its leaf is the same above them
         for(int j = 0; j < BUCKET_SIZE; j++){
             for(int k = 0; k < STASH_SPACE; k++){
-                int conditionsMet = (ORAM[nodeNumber].blocks[j].actualAddr == -1) && (stash[k].actualAddr != -1) && (((MAX_STATES/2)+targetLeaf-(div-1))/div == ((MAX_STATES/2)+stash[k].leaf-(div-1))/div);
+                int conditionsMet = (ORAM[nodeNumber].blocks[j].actualAddr == -1) && (stash[k].actualAddr != -1) && ((targetLeaf >> shift) == (stash[k].leaf >> shift));
                 //write to oram
-                for(int l = 0; l < sizeof(Oram_Block); l++){
-                    uint8_t v1 = ((uint8_t*)(&ORAM[nodeNumber].blocks[j]))[l];
-                    uint8_t v2 = ((uint8_t*)(&stash[k]))[l];
-                    ((uint8_t*)(&ORAM[nodeNumber].blocks[j]))[l] = (!conditionsMet*v1)+(conditionsMet*v2);
-                }                
+                condCopy(&ORAM[nodeNumber].blocks[j], &stash[k], words, ctMask(conditionsMet));
                 //remove from stash
-                stash[k].actualAddr = (conditionsMet*-1)+(!conditionsMet*stash[k].actualAddr);
+                stash[k].actualAddr = selectInt(conditionsMet, -1, stash[k].actualAddr);
             }
         }
         nodeNumber = (nodeNumber-1)/2;
@@ -276,77 +1121,862 @@ int opOram(int index, Oram_Block* block, int write){ //the actual oram ops
     //move first half of stash to second half of stash
     memmove(&stash[STASH_SPACE], stash, STASH_SPACE*sizeof(Oram_Block));
     memset(stash, 0xff, STASH_SPACE*sizeof(Oram_Block));
+    return oldValue;
 }
 
-void sortStash(int startIndex, int size, int flipped){//bitonic sort stash so all non -1 values appear before all -1 values
-    if(size <= 1) return; //ok to leak this branch, attacker knows we're in sorting network
-    else{
-        sortStash(startIndex, size/2, 1);
-        sortStash(startIndex+(size/2), size/2, 0);
-        mergeStash(startIndex, size, flipped);   
+unsigned int evictPath(Path_Oram* oram){
+    //the leaves in the order of their bit-reversed numbers, so consecutive evictions share as little of their paths
+    //as possible and every bucket is evicted from at a fixed rate
+    unsigned int leaves = oram->nodes/2+1;
+    int bits = oram->depth-1;
+    unsigned int g = oram->evictions++ % leaves, path = 0;
+    for(int i = 0; i < bits; i++) path |= ((g >> i) & 1) << (bits-1-i);
+    return path;
+}
+
+template<int Depth> Oram_Block* pathLevel(Path_Oram* oram, unsigned int leaf, int level, int* slots){
+    //slots of level of the path to leaf, counting the stash as level 0 and the root as 1 (public: the path is random)
+    if(level == 0){
+        *slots = CIRCUIT_STASH;
+        return oram->stash;
+    }
+    *slots = BUCKET_SIZE;
+    return oram->buckets[Oram_Tree<Depth>::node(leaf, level)].blocks;
+}
+
+int reachLevel(unsigned int leaf, unsigned int path, int depth){
+    //deepest level (root 1) of the path a block mapped to leaf may sit at: where the two paths part
+    int level = 0;
+    for(int i = 0; i < depth; i++){
+        level += ((leaf ^ path) >> i) == 0;
     }
+    return level;
 }
 
-void mergeStash(int startIndex, int size, int flipped){//bitonic merge
-    if(size == 1) return; //ok to leak this branch, attacker knows we're in sorting network
+template<int Depth> unsigned int circuitAccess(Path_Oram* oram, int index, Oram_Block* block, int write, int slot, unsigned int value){
+    //accessOram for ORAM_CIRCUIT (Wang, Chan and Shi, CCS 2015): the block is taken out of its path or the stash
+    //and put back in the stash on a new leaf, then two evictions move blocks down along paths picked in reverse
+    //lexicographic order. No step sorts or sweeps the stash against the path, so it stays CIRCUIT_STASH slots
+    //NOTE: a block arriving at a full stash would be lost; at CIRCUIT_STASH slots with BUCKET_SIZE 4 that is
+    //far less likely than Path ORAM overflowing STASH_SPACE
+    int words = oram->blockSize/sizeof(uint64_t);
+    unsigned int newLeaf, oldValue = 0;
+    Oram_Block found;
+    sgx_read_rand((uint8_t*)&newLeaf, sizeof(unsigned int));
+    newLeaf = newLeaf % Oram_Tree<Depth>::leaves;
+    unsigned int targetLeaf = remapOram(oram, index, newLeaf);
+
+    //read and remove: the block is copied out of whichever slot of the stash or the path holds it
+    memset(&found, 0, oram->blockSize);
+    found.actualAddr = -1;
+    for(int level = 0; level <= Depth; level++){
+        int slots;
+        Oram_Block* b = pathLevel<Depth>(oram, targetLeaf, level, &slots);
+        for(int i = 0; i < slots; i++){
+            int match = (b[i].actualAddr == index);
+            condCopy(&found, &b[i], words, ctMask(match));
+            b[i].actualAddr = selectInt(match, -1, b[i].actualAddr);
+        }
+    }
+    if(slot != -1) oldValue = swapLeaf(&found, 1, slot, value); //public: only position map levels pass a slot
+    if(write){
+        memcpy(&found, block, oram->blockSize);
+        found.actualAddr = index;
+    }
     else{
-        int swap = 0;
-        int half = size/2;
-        for(int i = 0; i < half; i++){
-            //only swap if there is a dummy block (-1) that needs to be moved to the end
-            swap = ((stash[startIndex+i].actualAddr == -1) != flipped); 
-            //compare and swap stash[startIndex+i] and stash[startIndex+i+half]
-            memcpy(&row, &stash[startIndex+i], sizeof(Oram_Block));//use row as temp storage
-            memcpy(&stash[startIndex+i], &stash[startIndex+i+half], sizeof(Oram_Block));
-            for(int j = 0; j < sizeof(Oram_Block); j++){
-                uint8_t v1 = ((uint8_t*)&row)[j];
-                uint8_t v2 = ((uint8_t*)&(stash[startIndex+half+i]))[j];
-                ((uint8_t*)(&stash[startIndex+i]))[j] = (!swap * v1) + (swap * v2);
-                ((uint8_t*)(&stash[startIndex+half+i]))[j] = (swap * v1) + (!swap * v2);
-            }
+        memcpy(block, &found, oram->blockSize);
+    }
+    found.leaf = newLeaf;
+
+    //into the first free slot of the stash
+    int place = 1;
+    for(int i = 0; i < CIRCUIT_STASH; i++){
+        int take = place & (oram->stash[i].actualAddr == -1);
+        condCopy(&oram->stash[i], &found, words, ctMask(take));
+        place &= !take;
+    }
+
+    evictCircuit<Depth>(oram, evictPath(oram));
+    evictCircuit<Depth>(oram, evictPath(oram));
+    return oldValue;
+}
+
+template<int Depth> void evictCircuit(Path_Oram* oram, unsigned int path){
+    //move blocks from the stash and the path as far down the path as they may go, at most one per level.
+    //The plan is made from the leaves of the blocks alone: reach[l] is how deep the deepest block at level l
+    //may go and slot[l] where it is, deepest[l] the level above l whose deepest block could come down to l, and
+    //target[l] where the block taken from l is to be dropped. Then one pass from the stash down carries at most
+    //one block at a time, picking up and dropping where the plan says. Every step is the same whatever the plan
+    int words = oram->blockSize/sizeof(uint64_t);
+    int reach[Depth+1], slot[Depth+1], empty[Depth+1];
+    int deepest[Depth+1], target[Depth+1];
+    for(int level = 0; level <= Depth; level++){
+        int slots;
+        Oram_Block* b = pathLevel<Depth>(oram, path, level, &slots);
+        reach[level] = -1;
+        slot[level] = 0;
+        empty[level] = 0;
+        for(int i = 0; i < slots; i++){
+            int real = (b[i].actualAddr != -1);
+            int r = selectInt(real, reachLevel(b[i].leaf, path, Depth), -1);
+            int deeper = (r > reach[level]);
+            reach[level] = selectInt(deeper, r, reach[level]);
+            slot[level] = selectInt(deeper, i, slot[level]);
+            empty[level] |= !real;
+        }
+    }
+
+    int src = -1, goal = -1;
+    for(int level = 0; level <= Depth; level++){
+        deepest[level] = selectInt(goal >= level, src, -1);
+        int deeper = (reach[level] > goal);
+        goal = selectInt(deeper, reach[level], goal);
+        src = selectInt(deeper, level, src);
+    }
+    int dest = -1;
+    src = -1;
+    for(int level = Depth; level >= 0; level--){
+        int arrive = (level == src);
+        target[level] = selectInt(arrive, dest, -1);
+        dest = selectInt(arrive, -1, dest);
+        src = selectInt(arrive, -1, src);
+        int leave = (((dest == -1) & empty[level]) | (target[level] != -1)) & (deepest[level] != -1);
+        src = selectInt(leave, deepest[level], src);
+        dest = selectInt(leave, level, dest);
+    }
+
+    Oram_Block hold, drop;
+    int holdDest = -1;
+    hold.actualAddr = -1;
+    for(int level = 0; level <= Depth; level++){
+        int slots;
+        Oram_Block* b = pathLevel<Depth>(oram, path, level, &slots);
+        int put = (hold.actualAddr != -1) & (level == holdDest);
+        drop.actualAddr = -1;
+        condCopy(&drop, &hold, words, ctMask(put));
+        hold.actualAddr = selectInt(put, -1, hold.actualAddr);
+        int pick = (target[level] != -1);
+        for(int i = 0; i < slots; i++){
+            int take = pick & (i == slot[level]);
+            condCopy(&hold, &b[i], words, ctMask(take));
+            b[i].actualAddr = selectInt(take, -1, b[i].actualAddr);
+        }
+        holdDest = selectInt(pick, target[level], selectInt(put, -1, holdDest));
+        int place = (drop.actualAddr != -1);
+        for(int i = 0; i < slots; i++){
+            int take = place & (b[i].actualAddr == -1);
+            condCopy(&b[i], &drop, words, ctMask(take));
+            place &= !take;
+        }
+    }
+}
+
+Oram_Block* ringBucket(Path_Oram* oram, int node){
+    return (Oram_Block*)oram->buckets + (size_t)node*RING_SLOTS;
+}
+
+void readBucket(Path_Oram* oram, int node, Oram_Block* out){
+    //the bucket's unread real blocks into out in slot order, dummies after them. Every slot is offered to every
+    //out block, so which slots held real blocks stays hidden
+    int words = oram->blockSize/sizeof(uint64_t);
+    Oram_Block* b = ringBucket(oram, node);
+    Ring_Meta* m = &oram->meta[node];
+    int rank = 0;
+    for(int k = 0; k < BUCKET_SIZE; k++) out[k].actualAddr = -1;
+    for(int i = 0; i < RING_SLOTS; i++){
+        int real = m->valid[i] & (m->addr[i] != -1);
+        for(int k = 0; k < BUCKET_SIZE; k++){
+            condCopy(&out[k], &b[i], words, ctMask(real & (k == rank)));
         }
-        mergeStash(startIndex, size/2, flipped);
-        mergeStash(startIndex+(size/2), size/2, flipped);
+        rank += real;
     }
 }
 
+void writeBucket(Path_Oram* oram, int node, const Oram_Block* in){
+    //the BUCKET_SIZE blocks of in, real or not, into slots of the bucket picked by a fresh random permutation,
+    //dummies into the other RING_DUMMIES, every slot unread. The permutation is drawn and applied without
+    //branching or indexing on it; only the reads that follow show slots, one random slot each
+    int words = oram->blockSize/sizeof(uint64_t);
+    Oram_Block* b = ringBucket(oram, node);
+    Ring_Meta* m = &oram->meta[node];
+    int perm[RING_SLOTS];
+    unsigned int rnd[RING_SLOTS];
+    sgx_read_rand((uint8_t*)rnd, sizeof(rnd));
+    for(int i = 0; i < RING_SLOTS; i++) perm[i] = i;
+    for(int i = RING_SLOTS-1; i > 0; i--){ //Fisher-Yates, swapping perm[i] with perm[j] through a scan
+        int j = ((uint64_t)rnd[i]*(i+1)) >> 32, at = perm[i], was = at;
+        for(int k = 0; k < i; k++){
+            was = selectInt(k == j, perm[k], was);
+            perm[k] = selectInt(k == j, at, perm[k]);
+        }
+        perm[i] = was;
+    }
+    for(int i = 0; i < RING_SLOTS; i++){
+        b[i].actualAddr = -1;
+        for(int k = 0; k < BUCKET_SIZE; k++){
+            condCopy(&b[i], &in[k], words, ctMask(perm[i] == k));
+        }
+        m->addr[i] = b[i].actualAddr;
+        m->valid[i] = 1;
+    }
+    m->count = 0;
+}
 
-int opDFA(char input){ //return >0 if accepting state, 0 otherwise
-        int change = 0, changed = 0;
-        int oldAcc = accepting;
-        accepting = 0;
-        //opOram(state, &block, 0);
-        //linear scan
-        memset(&block, 0, sizeof(Oram_Block));
-        int match = 0;
-        for(int i = 0; i < MAX_STATES; i++){
-            match = (i == state);
-            for(int j = 0; j < 256*sizeof(Entry); j++){
-                ((uint8_t*)&block.transitions)[j] += (match * ((uint8_t*)(&DFA[i*256]))[j]);
-            }
+template<int Depth> unsigned int ringAccess(Path_Oram* oram, int index, Oram_Block* block, int write, int slot, unsigned int value){
+    //accessOram for ORAM_RING (Ren et al., USENIX Security 2015): each bucket on the path gives up one slot, the
+    //block's if the metadata shows it there and otherwise an unread dummy picked at random, so one block a bucket
+    //is copied and the slots read look random either way. The block goes to the stash on a new leaf; a bucket
+    //read RING_DUMMIES times is rewritten, and every RING_EVICT_RATE accesses evictRing writes a path back
+    typedef Oram_Tree<Depth> Tree;
+    int words = oram->blockSize/sizeof(uint64_t);
+    unsigned int newLeaf, oldValue = 0;
+    unsigned int rnd[Depth+1];
+    Oram_Block found;
+    Oram_Block* stash = oram->stash+STASH_SPACE; //blocks kept between evictions, see evictRing
+    sgx_read_rand((uint8_t*)&newLeaf, sizeof(unsigned int));
+    sgx_read_rand((uint8_t*)rnd, sizeof(rnd));
+    newLeaf = newLeaf % Tree::leaves;
+    unsigned int targetLeaf = remapOram(oram, index, newLeaf);
+
+    //read and remove: from the stash, then one slot of each bucket
+    memset(&found, 0, oram->blockSize);
+    found.actualAddr = -1;
+    for(int i = 0; i < STASH_SPACE; i++){
+        int match = (stash[i].actualAddr == index);
+        condCopy(&found, &stash[i], words, ctMask(match));
+        stash[i].actualAddr = selectInt(match, -1, stash[i].actualAddr);
+    }
+    for(int level = 1; level <= Depth; level++){
+        int node = Tree::node(targetLeaf, level);
+        Ring_Meta* m = &oram->meta[node];
+        int hit = 0, hitSlot = 0, dummies = 0, dummySlot = 0;
+        for(int i = 0; i < RING_SLOTS; i++){
+            int h = m->valid[i] & (m->addr[i] == index);
+            hit |= h;
+            hitSlot = selectInt(h, i, hitSlot);
+            dummies += m->valid[i] & (m->addr[i] == -1);
+        }
+        //count is below RING_DUMMIES, so at least one dummy is unread
+        int pick = ((uint64_t)rnd[level]*dummies) >> 32;
+        for(int i = 0; i < RING_SLOTS; i++){
+            int dummy = m->valid[i] & (m->addr[i] == -1);
+            dummySlot = selectInt(dummy & (pick == 0), i, dummySlot);
+            pick -= dummy;
+        }
+        int s = selectInt(hit, hitSlot, dummySlot);
+        condCopy(&found, &ringBucket(oram, node)[s], words, ctMask(hit));
+        m->valid[s] = 0;
+        m->count++;
+    }
+    if(slot != -1) oldValue = swapLeaf(&found, 1, slot, value); //public: only position map levels pass a slot
+    if(write){
+        memcpy(&found, block, oram->blockSize);
+        found.actualAddr = index;
+    }
+    else{
+        memcpy(block, &found, oram->blockSize);
+    }
+    found.leaf = newLeaf;
+    int place = 1;
+    for(int i = 0; i < STASH_SPACE; i++){
+        int take = place & (stash[i].actualAddr == -1);
+        condCopy(&stash[i], &found, words, ctMask(take));
+        place &= !take;
+    }
+
+    //a bucket out of unread dummies is rewritten with the blocks it still holds
+    for(int level = 1; level <= Depth; level++){
+        int node = Tree::node(targetLeaf, level);
+        if(oram->meta[node].count >= RING_DUMMIES){ //public: counts only follow the paths read
+            Oram_Block in[BUCKET_SIZE];
+            readBucket(oram, node, in);
+            writeBucket(oram, node, in);
         }
+    }
+    if(++oram->accesses % RING_EVICT_RATE == 0) evictRing<Depth>(oram, evictPath(oram));
+    return oldValue;
+}
 
-        for(int i = 0; i < 256; i++){
-            changed = change || changed;
-            change = (input == block.transitions[i].transition);
-            change = change || (block.transitions[i].transition == 0 && !changed);
-            state = state*(1-change) + (change)*block.transitions[i].state;
+template<int Depth> void evictRing(Path_Oram* oram, unsigned int path){
+    //the real blocks of every bucket on path go to the front half of the stash, beside those kept in the back
+    //half, and are compacted; the buckets are then rewritten from the leaf up with the blocks that may go deepest,
+    //as in pathAccess, and the blocks left over move to the back half for the next accesses
+    typedef Oram_Tree<Depth> Tree;
+    int words = oram->blockSize/sizeof(uint64_t);
+    Oram_Block* stash = oram->stash;
+    Oram_Block in[BUCKET_SIZE];
+    int reach[STASH_SPACE];
+    for(int level = 1; level <= Depth; level++){
+        readBucket(oram, Tree::node(path, level), &stash[(level-1)*BUCKET_SIZE]);
+    }
+    compactStash(oram);
+    for(int i = 0; i < STASH_SPACE; i++){
+        reach[i] = selectInt(stash[i].actualAddr != -1, reachLevel(stash[i].leaf, path, Depth), 0);
+    }
+    for(int level = Depth; level >= 1; level--){
+        for(int k = 0; k < BUCKET_SIZE; k++){
+            int place = 1;
+            in[k].actualAddr = -1;
+            for(int i = 0; i < STASH_SPACE; i++){
+                int take = place & (reach[i] >= level);
+                condCopy(&in[k], &stash[i], words, ctMask(take));
+                stash[i].actualAddr = selectInt(take, -1, stash[i].actualAddr);
+                reach[i] = selectInt(take, 0, reach[i]);
+                place &= !take;
+            }
         }
-        
-        for(int i = 0; i < MAX_STATES; i++){
-            accepting = (accepting || (state == i && accStates[i]));
+        writeBucket(oram, Tree::node(path, level), in);
+    }
+    memmove(&stash[STASH_SPACE], stash, STASH_SPACE*sizeof(Oram_Block));
+    memset(stash, 0xff, STASH_SPACE*sizeof(Oram_Block));
+}
+
+void compactStash(Path_Oram* oram){
+    //move the real blocks of the 2*STASH_SPACE stash to its front, in order, without showing where any of them were.
+    //A real block's distance to its place is the number of dummies before it, which one counting pass gives every
+    //block as a small tag. Round j then moves each block whose distance has bit j set 2^j slots down: with the low
+    //bits done first no two blocks ever land on one slot (distances never shrink along the stash), so the slot a
+    //block moves into always holds a dummy and a round is one pass of conditional swaps 2^j apart. The tags, not the
+    //blocks, decide every swap: n log n word-wise swaps where the bitonic sort did n log^2 n / 4 byte-wise ones
+    Oram_Block* stash = oram->stash;
+    int words = oram->blockSize/sizeof(uint64_t); //actualAddr and leaf fill the first word, rows are whole words
+    int shift[2*STASH_SPACE];
+    int dummies = 0;
+    for(int i = 0; i < 2*STASH_SPACE; i++){
+        int real = (stash[i].actualAddr != -1);
+        shift[i] = dummies & -real;
+        dummies += !real;
+    }
+    for(int step = 1; step < 2*STASH_SPACE; step <<= 1){
+        for(int i = step; i < 2*STASH_SPACE; i++){
+            uint64_t move = ctMask((shift[i] & step) != 0);
+            condSwap(&stash[i-step], &stash[i], words, move);
+            int t = (shift[i-step] ^ shift[i]) & (int)move;
+            shift[i-step] ^= t;
+            shift[i] ^= t;
         }
-        //printf("DEBUG: input %c got us in state %d. Accepting? %d.\n", input, state, accepting);
-        return accepting;
+    }
+}
+
+int opDFA(Packed_Dfa* dfa, int* state, char input){ //advance *state on input, return the accept mask of the new state
+        uint64_t transitions[MAX_ROW_WORDS]; //local, as is *state (see getStates), so automata can be stepped from several threads
+        fetchRow(dfa, *state, transitions);
+
+        //map the input byte to its class, scanning the whole class table
+        int cls = lookupByte(dfa->classMap, 256, (uint8_t)input);
+
+        //column pick: unpack every entry in the row and keep the one for this input's class
+        //the entry holds the next state and, in its low acceptBits, the patterns that state accepts
+        uint64_t entry = selectField(transitions, dfa->rowWords, dfa->entriesPerWord, dfa->entryBits, cls);
+        *state = entry >> dfa->acceptBits;
+        return entry & (((uint64_t)1 << dfa->acceptBits) - 1);
+}
+
+void getStates(int* states){
+    //the scans hold the set only shared, so each steps its own copy of the automata's states: two at once then
+    //each run from whole states, and the one that finishes last leaves its states for the next runDFA
+    sgx_thread_mutex_lock(&stateMutex);
+    for(int d = 0; d < numDfas; d++) states[d] = dfaSet[d]->state;
+    sgx_thread_mutex_unlock(&stateMutex);
+}
+
+void putStates(const int* states){
+    sgx_thread_mutex_lock(&stateMutex);
+    for(int d = 0; d < numDfas; d++) dfaSet[d]->state = states[d];
+    sgx_thread_mutex_unlock(&stateMutex);
 }
 
 int runDFA(char* data, int length){
+    int states[MAX_PATTERNS];
+    lockSet(0);
+    getStates(states);
+    int accLoc = scanDFA(states, data, length);
+    putStates(states);
+    unlockSet(0);
+    return accLoc;
+}
+
+int scanDFA(int* states, const char* data, int length){ //runDFA from states, with the set lock already held
     int ret = -1, accLoc = -1;
     for(int i = 0; i < length; i++){
-        ret = opDFA(data[i]);
-        accLoc = (accLoc != -1 || !ret)*accLoc + (accLoc == -1 && ret)*i;
+        ret = 0;
+        for(int d = 0; d < numDfas; d++){
+            ret |= opDFA(dfaSet[d], &states[d], data[i]);
+        }
+        accLoc = firstHit(accLoc, ret != 0, i);
         //accepts as long as it accepted at any point, not if the whole DFA accepts
         //because we're doing more of a string search thing here
     }
     return accLoc;
 }
+
+int runDFAMulti(char* data, int length, int* accLocs, int maxPatterns){
+    //one pass over data that advances every loaded automaton on each byte; accLocs[p] gets the position
+    //where pattern p first matched, or -1. Returns the number of patterns, or -1 if accLocs is too short
+    int states[MAX_PATTERNS];
+    lockSet(0);
+    if(maxPatterns < numPatterns){
+        unlockSet(0);
+        return -1;
+    }
+    getStates(states);
+    for(int p = 0; p < maxPatterns; p++) accLocs[p] = -1;
+    for(int i = 0; i < length; i++){
+        for(int d = 0; d < numDfas; d++){
+            Packed_Dfa* dfa = dfaSet[d];
+            int mask = opDFA(dfa, &states[d], data[i]);
+            for(int b = 0; b < dfa->acceptBits; b++){
+                int hit = (mask >> b) & 1;
+                int* accLoc = &accLocs[dfa->firstPattern+b];
+                *accLoc = firstHit(*accLoc, hit, i);
+            }
+        }
+    }
+    putStates(states);
+    int ret = numPatterns;
+    unlockSet(0);
+    return ret;
+}
+
+int opDFABatch(Packed_Dfa* dfa, int* states, const char* inputs, int count, int* masks){ //opDFA on count streams at once
+        uint64_t transitions[MAX_BATCH*MAX_ROW_WORDS];
+        if(count > MAX_BATCH) return -1;
+        //one linear scan of the table picks the current row of every stream; through ORAM each stream costs an access
+        if(dfa->backend != DFA_BACKEND_SCAN){
+            for(int k = 0; k < count; k++) fetchRow(dfa, states[k], &transitions[k*dfa->rowWords]);
+        }
+        else{
+            selectRows(transitions, dfa->table, dfa->numStates, dfa->rowWords, states, count);
+        }
+
+        for(int k = 0; k < count; k++){
+            int cls = lookupByte(dfa->classMap, 256, (uint8_t)inputs[k]);
+            uint64_t entry = selectField(&transitions[k*dfa->rowWords], dfa->rowWords, dfa->entriesPerWord, dfa->entryBits, cls);
+            states[k] = entry >> dfa->acceptBits;
+            masks[k] = entry & (((uint64_t)1 << dfa->acceptBits) - 1);
+        }
+        return 0;
+}
+
+int runDFABatch(char* data, int length, int count, int* accLocs){
+    //scan count documents of length bytes each (document k at data[k*length]) in lockstep, MAX_BATCH at a time,
+    //so each step streams every automaton's table once for the whole group instead of once per document.
+    //Each document starts from the start state; accLocs[k] gets the earliest match of any pattern in document k, or -1
+    //shorter documents must be padded to length by the caller, who drops matches that start in the padding
+    int states[MAX_PATTERNS][MAX_BATCH];
+    int masks[MAX_BATCH];
+    char inputs[MAX_BATCH];
+    lockSet(0);
+    if(numDfas == 0){
+        unlockSet(0);
+        return -1;
+    }
+    for(int g = 0; g < count; g += MAX_BATCH){
+        int n = (count-g < MAX_BATCH) ? count-g : MAX_BATCH;
+        for(int d = 0; d < numDfas; d++){
+            for(int k = 0; k < n; k++) states[d][k] = 0;
+        }
+        for(int k = 0; k < n; k++) accLocs[g+k] = -1;
+        for(int i = 0; i < length; i++){
+            int ret[MAX_BATCH] = {0};
+            for(int k = 0; k < n; k++) inputs[k] = data[(size_t)(g+k)*length+i];
+            for(int d = 0; d < numDfas; d++){
+                opDFABatch(dfaSet[d], states[d], inputs, n, masks);
+                for(int k = 0; k < n; k++) ret[k] |= masks[k];
+            }
+            for(int k = 0; k < n; k++){
+                int* accLoc = &accLocs[g+k];
+                *accLoc = firstHit(*accLoc, ret[k] != 0, i);
+            }
+        }
+    }
+    unlockSet(0);
+    return 0;
+}
+
+int enumDFA(Packed_Dfa* dfa, const char* data, int length, int* ends, int* firsts){
+    //run data from every state of dfa at once: ends[s] is the state a run started in s finishes in and
+    //firsts[s] the offset of its first accepting byte, or -1. All runs read the same byte, so each step
+    //extracts that byte's column of the table once and moves every run through it with a masked gather
+    //costs numStates^2 per byte, which is why runDFAParallel gives these chunks so little of the input
+    //returns 0, or -1 with ends and firsts unset if there is no memory for the column
+    int n = dfa->numStates;
+    uint64_t fieldMask = ((uint64_t)1 << dfa->entryBits) - 1;
+    uint64_t acceptMask = ((uint64_t)1 << dfa->acceptBits) - 1;
+    uint64_t* col = (uint64_t*)malloc(n*sizeof(uint64_t));
+    if(!col) return -1;
+    int column[256]; //word of the row holding each input byte's entry times 64, plus the entry's shift in it
+    for(int c = 0; c < 256; c++){ //divides by the public loop index, never by an input class
+        int cls = dfa->classMap[c];
+        column[c] = (cls / dfa->entriesPerWord)*64 + (cls % dfa->entriesPerWord)*dfa->entryBits;
+    }
+    for(int s = 0; s < n; s++){
+        ends[s] = s;
+        firsts[s] = -1;
+    }
+    for(int i = 0; i < length; i++){
+        //the word holding the column is picked with a masked scan; shifts by a register are constant time
+        int at = lookupInt(column, 256, (uint8_t)data[i]);
+        int word = at >> 6, shift = at & 63;
+        for(int t = 0; t < n; t++){
+            col[t] = (lookupWord(&dfa->table[t*dfa->rowWords], dfa->rowWords, word) >> shift) & fieldMask;
+        }
+        for(int s = 0; s < n; s++){
+            uint64_t e = lookupWord(col, n, ends[s]);
+            int hit = (e & acceptMask) != 0;
+            ends[s] = e >> dfa->acceptBits;
+            firsts[s] = firstHit(firsts[s], hit, i);
+        }
+    }
+    free(col);
+    return 0;
+}
+
+void runChunk(int chunk){
+    //chunk 0 starts where runDFA left off, so only that one run is followed; the others start in an unknown state
+    const char* data = job.data + job.bounds[chunk];
+    int length = job.bounds[chunk+1] - job.bounds[chunk];
+    int base = chunk*job.stride;
+    for(int d = 0; d < numDfas; d++){
+        Packed_Dfa* dfa = dfaSet[d];
+        if(chunk == 0){
+            int state = job.starts[d], first = -1;
+            for(int i = 0; i < length; i++){
+                int hit = opDFA(dfa, &state, data[i]) != 0;
+                first = firstHit(first, hit, i);
+            }
+            job.ends[base] = state;
+            job.firsts[base] = first;
+        }
+        else if(enumDFA(dfa, data, length, &job.ends[base], &job.firsts[base]) != 0){
+            sgx_thread_mutex_lock(&job.mutex);
+            job.failed = 1;
+            sgx_thread_mutex_unlock(&job.mutex);
+        }
+        base += dfa->numStates;
+    }
+}
+
+void workChunks(){
+    for(;;){
+        sgx_thread_mutex_lock(&job.mutex);
+        int chunk = (job.nextChunk < job.numChunks) ? job.nextChunk++ : -1;
+        sgx_thread_mutex_unlock(&job.mutex);
+        if(chunk == -1) return;
+        runChunk(chunk);
+    }
+}
+
+int runDFAWorker(){
+    //lend this thread to the next runDFAParallel call that asks for workers; returns once it has no more chunks
+    //the untrusted side starts one such ecall per worker it passes to runDFAParallel. A worker takes no set lock:
+    //it only touches the set while the job is active, and runDFAParallel holds the lock until every worker is done
+    sgx_thread_mutex_lock(&job.mutex);
+    while(!job.active || job.workersJoined == job.workersWanted){
+        sgx_thread_cond_wait(&job.ready, &job.mutex);
+    }
+    job.workersJoined++;
+    sgx_thread_mutex_unlock(&job.mutex);
+
+    workChunks();
+
+    sgx_thread_mutex_lock(&job.mutex);
+    job.workersDone++;
+    sgx_thread_cond_signal(&job.done);
+    sgx_thread_mutex_unlock(&job.mutex);
+    return 0;
+}
+
+int runDFAParallel(char* data, int length, int numWorkers){
+    //runDFA over numWorkers+1 chunks worked on at once by this thread and numWorkers runDFAWorker threads
+    //chunk 0 follows the real run, later chunks are run from every state (enumDFA) and the per-chunk state maps
+    //are composed afterwards, picking each chunk's result for the state the previous one ended in with a masked scan
+    //chunk sizes come from the tiers and length alone: an enumerated byte costs about numStates times a followed one,
+    //so large tiers leave nearly all the input to chunk 0. Returns the earliest match like runDFA, or -1
+    //if a chunk could not be enumerated for lack of memory the whole input is scanned serially instead, so the
+    //result is always runDFA's. Blocks until all numWorkers workers have joined, so the caller must start them
+    if(numWorkers < 0 || numWorkers > MAX_WORKERS) return -1;
+    lockSet(0);
+    if(numDfas == 0){
+        unlockSet(0);
+        return -1;
+    }
+    int chunks = numWorkers+1, stride = 0, accLoc = -1;
+    int64_t follow = 0, enumerate = 0; //rough work per byte for chunk 0 and for the enumerated chunks
+    for(int d = 0; d < numDfas; d++){
+        Packed_Dfa* dfa = dfaSet[d];
+        stride += dfa->numStates;
+        follow += 256 + dfa->numStates*dfa->rowWords + dfa->numClasses;
+        enumerate += 256 + dfa->numStates*(dfa->rowWords+1) + 2*(int64_t)dfa->numStates*dfa->numStates; //the gather dominates
+    }
+    //each enumerated chunk gets follow/enumerate of what chunk 0 gets, so they all take about as long
+    int share = (int)((int64_t)length*follow / (enumerate + (chunks-1)*follow));
+    int* ends = (int*)malloc(chunks*stride*sizeof(int));
+    int* firsts = (int*)malloc(chunks*stride*sizeof(int));
+    if(!ends || !firsts){
+        unlockSet(0);
+        free(ends); free(firsts);
+        return -1;
+    }
+
+    sgx_thread_mutex_lock(&job.mutex);
+    if(job.active){ //one parallel call at a time
+        sgx_thread_mutex_unlock(&job.mutex);
+        unlockSet(0);
+        free(ends); free(firsts);
+        return -1;
+    }
+    job.data = data;
+    job.numChunks = chunks;
+    job.bounds[0] = 0;
+    job.bounds[1] = length - (chunks-1)*share;
+    for(int c = 2; c <= chunks; c++) job.bounds[c] = job.bounds[c-1] + share;
+    job.nextChunk = 0;
+    job.stride = stride;
+    getStates(job.starts);
+    job.ends = ends;
+    job.firsts = firsts;
+    job.failed = 0;
+    job.workersWanted = numWorkers;
+    job.workersJoined = 0;
+    job.workersDone = 0;
+    job.active = 1;
+    sgx_thread_cond_broadcast(&job.ready);
+    sgx_thread_mutex_unlock(&job.mutex);
+
+    workChunks();
+
+    sgx_thread_mutex_lock(&job.mutex);
+    while(job.workersDone < job.workersWanted){
+        sgx_thread_cond_wait(&job.done, &job.mutex);
+    }
+    job.active = 0;
+    int failed = job.failed;
+    sgx_thread_mutex_unlock(&job.mutex);
+    if(failed){
+        int states[MAX_PATTERNS];
+        memcpy(states, job.starts, numDfas*sizeof(int));
+        accLoc = scanDFA(states, data, length);
+        putStates(states);
+        unlockSet(0);
+        free(ends); free(firsts);
+        return accLoc;
+    }
+
+    //compose: follow each automaton's run through the chunk maps, then keep the earliest match over automata
+    int states[MAX_PATTERNS];
+    int base = 0;
+    for(int d = 0; d < numDfas; d++){
+        Packed_Dfa* dfa = dfaSet[d];
+        int state = ends[base], first = firsts[base];
+        for(int c = 1; c < chunks; c++){
+            const int* e = &ends[c*stride+base];
+            const int* f = &firsts[c*stride+base];
+            int next = lookupInt(e, dfa->numStates, state);
+            int at = lookupInt(f, dfa->numStates, state);
+            int found = (at != -1);
+            first = firstHit(first, found, job.bounds[c]+at);
+            state = next;
+        }
+        states[d] = state;
+        int take = (first != -1) && (accLoc == -1 || first < accLoc);
+        accLoc = selectInt(take, first, accLoc);
+        base += dfa->numStates;
+    }
+    putStates(states);
+    unlockSet(0);
+    free(ends); free(firsts);
+    return accLoc;
+}
+
+int openSession(){
+    //start a stream against the loaded set: every automaton in its start state, nothing fed yet
+    //memory per session is fixed, however long the stream. Returns the handle, or -1 if none are free
+    int session = -1;
+    lockSet(0);
+    if(numDfas > 0){
+        sgx_thread_mutex_lock(&sessionMutex);
+        for(int i = 0; i < MAX_SESSIONS && session == -1; i++){
+            if(!sessions[i].inUse) session = i;
+        }
+        if(session != -1) sessions[session].inUse = 1;
+        sgx_thread_mutex_unlock(&sessionMutex);
+    }
+    if(session != -1){
+        Session* sn = &sessions[session];
+        sn->setVersion = setVersion;
+        sn->offset = 0;
+        for(int d = 0; d < numDfas; d++) sn->states[d] = 0;
+        for(int p = 0; p < numPatterns; p++) sn->accLocs[p] = -1;
+    }
+    unlockSet(0);
+    return session;
+}
+
+int feedSession(int session, char* data, int length){
+    //scan the next length bytes of the stream; state, first matches and offset carry over to the next chunk
+    //a session is fed by one thread at a time. Returns 0, or -1 for a bad handle or a set loaded since it was opened
+    //the set lock is held over both the version check and the scan, so the set checked is the one scanned
+    if(session < 0 || session >= MAX_SESSIONS || !sessions[session].inUse) return -1;
+    Session* sn = &sessions[session];
+    lockSet(0);
+    int ret = (sn->setVersion == setVersion && length >= 0) ? 0 : -1;
+    if(ret == 0) scanSession(sn, data, length);
+    unlockSet(0);
+    return ret;
+}
+
+void scanSession(Session* sn, const char* data, int length){
+    for(int i = 0; i < length; i++){
+        int64_t at = sn->offset + i;
+        for(int d = 0; d < numDfas; d++){
+            Packed_Dfa* dfa = dfaSet[d];
+            int mask = opDFA(dfa, &sn->states[d], data[i]);
+            for(int b = 0; b < dfa->acceptBits; b++){
+                int hit = (mask >> b) & 1;
+                int64_t* accLoc = &sn->accLocs[dfa->firstPattern+b];
+                *accLoc = selectWord(ctMask(hit & (*accLoc == -1)), at, *accLoc);
+            }
+        }
+    }
+    sn->offset += length;
+}
+
+int finalizeSession(int session, int64_t* accLocs, int maxPatterns, int64_t* accLoc){
+    //report the first match of each pattern in accLocs and of any pattern in accLoc (-1 for none), then close
+    //the session. Returns the number of patterns, or -1 for a bad handle or an accLocs too short for them
+    if(session < 0 || session >= MAX_SESSIONS || !sessions[session].inUse) return -1;
+    Session* sn = &sessions[session];
+    lockSet(0);
+    int ret = (sn->setVersion == setVersion && maxPatterns >= numPatterns) ? numPatterns : -1;
+    *accLoc = -1;
+    for(int p = 0; p < maxPatterns; p++) accLocs[p] = -1;
+    for(int p = 0; p < numPatterns && ret != -1; p++){
+        int64_t first = sn->accLocs[p];
+        int take = (first != -1) && (*accLoc == -1 || first < *accLoc);
+        *accLoc = selectWord(ctMask(take), first, *accLoc);
+        accLocs[p] = first;
+    }
+    unlockSet(0);
+    sgx_thread_mutex_lock(&sessionMutex);
+    sn->inUse = 0;
+    sgx_thread_mutex_unlock(&sessionMutex);
+    return ret;
+}
+
+int runDFAUntrusted(char* data, int length){
+    //runDFA on a [user_check] buffer: it is copied into a trusted stage STAGE_SIZE bytes at a time and each stage is
+    //scanned, so there is no allocation or copy of the whole input. Each byte is read from untrusted memory once,
+    //so the host rewriting the buffer mid-scan cannot show the enclave two different values for it
+    //returns the first match like runDFA, or -1 if the buffer is not entirely outside the enclave
+    char stage[STAGE_SIZE];
+    int states[MAX_PATTERNS];
+    int accLoc = -1;
+    if(length < 0 || !sgx_is_outside_enclave(data, length)) return -1;
+    lockSet(0); //one set for the whole buffer
+    getStates(states);
+    for(int off = 0; off < length; off += STAGE_SIZE){
+        int n = (length-off < STAGE_SIZE) ? length-off : STAGE_SIZE;
+        memcpy(stage, data+off, n);
+        int at = scanDFA(states, stage, n);
+        int found = (at != -1);
+        accLoc = firstHit(accLoc, found, off+at);
+    }
+    putStates(states);
+    unlockSet(0);
+    return accLoc;
+}
+
+int feedSessionUntrusted(int session, char* data, int length){
+    //feedSession on a [user_check] buffer, staged the same way as runDFAUntrusted
+    char stage[STAGE_SIZE];
+    int ret = 0;
+    if(length < 0 || !sgx_is_outside_enclave(data, length)) return -1;
+    for(int off = 0; off < length && ret == 0; off += STAGE_SIZE){
+        int n = (length-off < STAGE_SIZE) ? length-off : STAGE_SIZE;
+        memcpy(stage, data+off, n);
+        ret = feedSession(session, stage, n);
+    }
+    return ret;
+}
+
+int64_t hotcallRun(char* data, int length){
+    //HOTCALL_RUN: scan an untrusted buffer from the start states with a session kept on the stack, so any number
+    //of workers can run requests at once without touching the automata's runDFA state
+    char stage[STAGE_SIZE];
+    Session sn;
+    int64_t accLoc = -1;
+    if(length < 0 || !sgx_is_outside_enclave(data, length)) return -1;
+    lockSet(0);
+    sn.offset = 0;
+    for(int d = 0; d < numDfas; d++) sn.states[d] = 0;
+    for(int p = 0; p < numPatterns; p++) sn.accLocs[p] = -1;
+    for(int off = 0; off < length; off += STAGE_SIZE){
+        int n = (length-off < STAGE_SIZE) ? length-off : STAGE_SIZE;
+        memcpy(stage, data+off, n);
+        scanSession(&sn, stage, n);
+    }
+    for(int p = 0; p < numPatterns; p++){
+        int take = (sn.accLocs[p] != -1) && (accLoc == -1 || sn.accLocs[p] < accLoc);
+        accLoc = selectWord(ctMask(take), sn.accLocs[p], accLoc);
+    }
+    unlockSet(0);
+    return accLoc;
+}
+
+int64_t hotcallDo(hotcall_request_t* req){
+    //run one request; its fields are copied in first since the App can still write to them
+    int op = req->op, session = req->session, length = req->length;
+    char* data = req->data;
+    int64_t result = -1;
+    if(op == HOTCALL_RUN){
+        result = hotcallRun(data, length);
+    }
+    else if(op == HOTCALL_OPEN){
+        result = openSession();
+    }
+    else if(op == HOTCALL_FEED){
+        result = feedSessionUntrusted(session, data, length);
+    }
+    else if(op == HOTCALL_FINALIZE){
+        int64_t accLocs[MAX_PATTERNS];
+        int64_t accLoc = -1;
+        if(length < 0 || length > MAX_PATTERNS || (data && !sgx_is_outside_enclave(data, length*sizeof(int64_t)))) return -1;
+        if(finalizeSession(session, accLocs, MAX_PATTERNS, &accLoc) == -1) return -1;
+        if(data) memcpy(data, accLocs, length*sizeof(int64_t));
+        result = accLoc;
+    }
+    return result;
+}
+
+int hotcallServe(hotcall_ring_t* ring){
+    //serve requests from a ring in untrusted memory until the App sets stop, so a scan costs no enclave transition.
+    //Each worker thread runs one of these on a spare TCS slot; slots are taken with a compare-and-swap, so several
+    //workers can share a ring. Spins with pause while idle and, after HOTCALL_SPINS empty sweeps, sleeps in an ocall
+    //once per sweep until work shows up. Requests on one session must not be posted before the previous one is done
+    //each request holds the set lock only while it runs, so a set can be loaded between requests but never under one
+    //returns the number of requests served, or -1 if the ring is not in untrusted memory
+    int served = 0, idle = 0, slot = 0;
+    if(!sgx_is_outside_enclave(ring, sizeof(hotcall_ring_t))) return -1;
+    while(!ring->stop){
+        hotcall_request_t* req = &ring->slots[slot];
+        slot = (slot+1) % HOTCALL_SLOTS;
+        if(req->status != HOTCALL_POSTED || !__sync_bool_compare_and_swap(&req->status, HOTCALL_POSTED, HOTCALL_TAKEN)){
+            if(slot == 0 && ++idle >= HOTCALL_SPINS){
+                ocall_hotcall_idle();
+                idle = HOTCALL_SPINS-1;
+            }
+            else{
+                __builtin_ia32_pause();
+            }
+            continue;
+        }
+        __sync_synchronize(); //read the request only after taking it
+        req->result = hotcallDo(req);
+        __sync_synchronize(); //publish the result before the status
+        req->status = HOTCALL_DONE;
+        served++;
+        idle = 0;
+    }
+    return served;
+}
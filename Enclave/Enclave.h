@@ -34,57 +34,335 @@
 #define _ENCLAVE_H_
 
 #include <stdlib.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <assert.h>
 #include <math.h>
 #include "string.h"
 #include "sgx_trts.h"
+#include "sgx_thread.h"
+#include "sgx_tseal.h"
+#include "user_types.h"
+#if defined(DFA_UNTRUSTED)
+#include <stdio.h> //the enclave sources built into dfac and Tests/dfatest print with the C library
+#endif
 
 
 #if defined(__cplusplus)
 extern "C" {
 #endif
     
-#define MAX_STATES 511 //size of block in terms of entries
+#define NUM_STATE_TIERS 5
+static const int STATE_TIERS[NUM_STATE_TIERS] = {16, 64, 256, 1024, 4096}; //public sizes a DFA is padded to, picked at load time
+#define MAX_ACCEPT_BITS 8 //patterns one automaton reports on, one accept bit each; larger sets are split over several automata
+#define MAX_ROW_WORDS 86 //a packed row of 256 classes of 20-bit entries (the 4096 tier with 8 accept bits), 3 entries to a word
+#define MAX_PATTERNS 64 //patterns in a set loaded by prepDFASet
+#define MAX_WORKERS 9 //worker threads a runDFAParallel call can use: TCSNum less the calling thread
+#define STAGE_SIZE 4096 //bytes of untrusted input the [user_check] ecalls copy in per step
+#define MAX_SESSIONS 16 //streaming sessions open at once
+#define HOTCALL_SPINS 4096 //empty sweeps of the ring a hotcall worker spins through before it sleeps in an ocall
+#define MAX_BATCH 16 //documents runDFABatch advances per table scan; their current rows must stay in L1
+#define MAX_CACHED 32 //compiled sets cacheDFASet keeps at once
+#define CACHE_BUDGET (16 << 20) //bytes of tables and ORAMs the cache may hold, half of HeapMaxSize in Enclave.config.xml
+#define SEAL_CHUNK (1 << 18) //bytes of a set sealed into one record: bounds the ocall copy and the staging buffer
+#define SEAL_PARTS 5 //pieces of memory sealed per automaton, see dfaParts
+#define SEAL_VERSION 6 //bumped when what sealDFASet writes changes
+#define SEAL_FLAGS_MASK 0xFF0000000000000BULL //the attribute and misc masks sgx_seal_data uses
+#define SEAL_MISC_MASK 0xF0000000
 #define BUCKET_SIZE 4
-#define STASH_SPACE 128 //should be something like 90+4*log_2(MAX_STATES) for 2^-80 prob of failure on each access, but make it a power of 2
-    
-typedef struct{
-    char transition;
-    uint8_t state;
-} Entry;
+#define STASH_SPACE 128 //should be something like 90+4*log_2(numStates) for 2^-80 prob of failure on each access, but make it a power of 2
+#define ORAM_PATH 0 //Path_Oram scheme: Path ORAM, evicting along the path just read through the whole stash
+#define ORAM_CIRCUIT 1 //Path_Oram scheme: Circuit ORAM, two planned evictions an access, see circuitAccess
+#define ORAM_RING 2 //Path_Oram scheme: Ring ORAM, one block read a bucket and an eviction every few accesses, see ringAccess
+#define CIRCUIT_STASH 32 //stash slots Circuit ORAM uses, whatever the tree size; the rest of the allocation is idle
+#define RING_DUMMIES 4 //Ring ORAM reads a bucket this many times between rewrites, so it keeps as many dummy slots
+#define RING_SLOTS (BUCKET_SIZE+RING_DUMMIES) //slots of a Ring ORAM bucket
+#define RING_EVICT_RATE 3 //Ring ORAM accesses between evictions, the largest Ren et al. give for BUCKET_SIZE 4
+#define MAX_TREE_DEPTH 13 //levels of buckets in the tree of the largest of STATE_TIERS, the deepest ORAM tree; accessOram has code for each depth up to it
+#define SCAN_WORD_COST 270 //picoseconds selectRow takes per 64-bit word of table
+#define SCAN_ROW_COST 2500 //picoseconds selectRow takes per row of table, whatever its width
+#define ORAM_WORD_COST 360 //picoseconds pathAccess takes per 64-bit block word it offers to a bucket slot on eviction
+#define ORAM_SLOT_COST 3000 //picoseconds pathAccess takes per block it offers to a bucket slot, whatever its width
+#define COMPACT_WORD_COST 420 //picoseconds compactStash takes per 64-bit word it conditionally swaps
+#define COMPACT_SWAP_COST 1900 //picoseconds compactStash takes per pair of blocks it conditionally swaps
+#define CIRCUIT_WORD_COST 510 //picoseconds circuitAccess takes per 64-bit word of a slot it reads or writes
+#define CIRCUIT_SLOT_COST 1800 //picoseconds circuitAccess takes per slot and tree level to plan an eviction
+#define RING_WORD_COST 380 //picoseconds ringAccess takes per 64-bit word of a block it conditionally copies
+#define RING_COPY_COST 4100 //picoseconds ringAccess takes per block it conditionally copies, whatever its width
+#define POSMAP_ENTRY_COST 400 //picoseconds per leaf of a position map scanned in full
+#define POSMAP_FANOUT 32 //leaves packed into a block of a position map ORAM
+#define POSMAP_BLOCK_SIZE (offsetof(Oram_Block, transitions) + POSMAP_FANOUT*sizeof(unsigned int)) //blockSize of those ORAMs
+#define MAX_ORAM_LEVELS 8 //an ORAM and the position map ORAMs under it; 2^31 blocks need 7 at POSMAP_FANOUT 32
+#if !defined(POSMAP_FORCE_FROM)
+#define POSMAP_FORCE_FROM 0 //if set, position maps of more blocks than this recurse whatever they cost; see recursePosMap
+#endif
+#define NUM_CLASS_TIERS 5
+static const int CLASS_TIERS[NUM_CLASS_TIERS] = {16, 32, 64, 128, 256}; //public row widths; only the tier, not the class count, is visible
     
 typedef struct{
 	int actualAddr;
-	Entry transitions[256];//possibility of a different transition for each symbol
 	unsigned int leaf; //we have each block keep track of its leaf to avoid a bunch of linear scans of the posMap
+	uint64_t transitions[MAX_ROW_WORDS];//packed next state for each input class, only the first rowWords are used (keep last, see blockSize)
 } Oram_Block;
 
 typedef struct{
 	Oram_Block blocks[BUCKET_SIZE];
 } Oram_Bucket;
 
-extern Entry DFA[MAX_STATES*256];
-extern Oram_Bucket ORAM[MAX_STATES];
-extern unsigned int posMap[MAX_STATES];
-extern Oram_Block stash[2*STASH_SPACE];
-extern int accStates[MAX_STATES];
-extern int accepting; //0 means no, any positive number means yes and it started at the index of that number
-extern Oram_Block row;
+typedef struct{ //Ring ORAM bookkeeping of one bucket, kept apart from its slots so an access reads one block a bucket
+    int addr[RING_SLOTS]; //block in each slot, -1 for a dummy
+    uint8_t valid[RING_SLOTS]; //slot not read since the bucket was last written
+    int count; //reads since the bucket was last written; public, as it only follows the paths read
+} Ring_Meta;
+
+typedef struct{ //an automaton being loaded: real rows only, unpacked
+    uint16_t* rows; //rows[s*numClasses+classMap[c]] is the next state from s on input c
+    int* accStates; //accept mask of each state, bit p set if the state accepts pattern p of this automaton
+    uint8_t classMap[256]; //input byte -> column of its equivalence class
+    int numStates;
+    int numClasses; //row stride
+    int numPatterns; //accept bits in use
+} Staged_Dfa;
+
+typedef struct Path_Oram{ //one level of a recursive Path ORAM, see allocOram
+    Oram_Bucket* buckets; //bucketSlots(scheme) blocks a node
+    unsigned int* posMap; //leaf of each block, NULL unless this is the last level
+    Oram_Block* stash; //2*STASH_SPACE blocks
+    int nodes; //buckets in the tree
+    int numBlocks;
+    int blockSize; //bytes of an Oram_Block that are in use for the row width
+    int depth; //levels of buckets from root to leaf, which picks the code accessOram runs
+    struct Path_Oram* posOram; //the next level: this one's position map, POSMAP_FANOUT leaves a block; NULL if posMap is scanned
+    int scheme; //ORAM_PATH, ORAM_CIRCUIT or ORAM_RING, the same on every level
+    unsigned int evictions; //Circuit and Ring ORAM evictions so far, which picks the next eviction path
+    unsigned int accesses; //Ring ORAM accesses so far, every RING_EVICT_RATE-th one evicts
+    Ring_Meta* meta; //Ring ORAM: one per bucket, NULL for the other schemes
+} Path_Oram;
+
+typedef struct{ //an automaton ready to run: padded to a tier and packed
+    uint64_t* table; //bits [(k%entriesPerWord)*entryBits, +entryBits) of table[s*rowWords+k/entriesPerWord], k = classMap[c], hold (next state << acceptBits | accept mask of next state) for state s on input c
+    uint8_t classMap[256];
+    int numStates; //one of STATE_TIERS
+    int numClasses; //one of CLASS_TIERS
+    int stateBits; //bits per next-state id, ceil(log2(numStates))
+    int acceptBits; //bits of accept mask in each entry, one per pattern
+    int entryBits;
+    int entriesPerWord; //entries do not straddle words
+    int rowWords;
+    int firstPattern; //number in the loaded set of the pattern on accept bit 0
+    int state; //state the last runDFA, runDFAMulti or runDFAParallel left it in; each scans a copy, see getStates
+    int backend; //DFA_BACKEND_ORAM, _CIRCUIT or _RING if opDFA fetches rows from oram, otherwise it scans table; see chooseBackend
+    Path_Oram oram; //buckets are NULL until initDFA
+} Packed_Dfa;
+
+typedef struct{ //a runDFAParallel call, shared with the threads lent to it by runDFAWorker
+    const char* data;
+    int bounds[MAX_WORKERS+2]; //chunk c is data[bounds[c]..bounds[c+1])
+    int numChunks;
+    int nextChunk; //next chunk to hand out
+    int stride; //states over all automata
+    int starts[MAX_PATTERNS]; //state each automaton starts chunk 0 in
+    int* ends; //ends[c*stride+base+s]: state after chunk c when the automaton at base starts it in s
+    int* firsts; //offset into chunk c of the first accepting byte on that run, -1 if none
+    int failed; //a chunk could not be enumerated, see enumDFA
+    int workersWanted, workersJoined, workersDone;
+    int active;
+    sgx_thread_mutex_t mutex;
+    sgx_thread_cond_t ready; //a job was posted
+    sgx_thread_cond_t done; //a worker finished
+} Parallel_Job;
+
+typedef struct{ //who is using the loaded set, see lockSet
+    int readers; //threads holding it shared
+    int writing; //1 while a thread holds it exclusively
+    int writers; //threads waiting to hold it exclusively; new readers wait behind them
+    sgx_thread_mutex_t mutex;
+    sgx_thread_cond_t released; //the writer or the last reader let go
+} Set_Lock;
+
+typedef struct{ //a stream scanned in chunks, see openSession
+    int inUse;
+    int setVersion; //loaded set the session was opened against
+    int states[MAX_PATTERNS]; //current state of each loaded automaton
+    int64_t accLocs[MAX_PATTERNS]; //first match of each pattern as an offset into the stream, -1 if none yet
+    int64_t offset; //bytes fed so far
+} Session;
+
+typedef struct{ //a compiled set kept ready to run, see cacheDFASet
+    int inUse;
+    int generation; //bumped each time the slot is refilled; handles are generation*MAX_CACHED+slot
+    uint8_t digest[32]; //SHA-256 of the pattern text
+    Packed_Dfa* dfas[MAX_PATTERNS]; //packed, with ORAMs initialized
+    int numDfas;
+    size_t bytes; //charged against CACHE_BUDGET, see dfaBytes
+    uint64_t lastUse;
+} Cache_Entry;
+
+typedef struct{ //MAC text of each sealed record, tying it to its place in one sealed set
+    uint8_t setId[16]; //random per sealDFASet call
+    uint32_t version; //SEAL_VERSION
+    uint32_t index; //record number, the header is 0
+    uint32_t count; //records in the set
+    uint32_t reserved;
+} Seal_Aad;
+
+typedef struct{ //first sealed record of a set: the shape of each automaton, only the first numDfas entries are sealed
+    uint32_t numDfas;
+    uint32_t reserved;
+    uint32_t schemes[MAX_PATTERNS]; //scheme of each automaton's ORAM
+    uint32_t evictions[MAX_PATTERNS][MAX_ORAM_LEVELS]; //evictions of each level of each ORAM, see Path_Oram
+    uint32_t accesses[MAX_PATTERNS][MAX_ORAM_LEVELS];
+    dfa_image_entry_t entries[MAX_PATTERNS];
+} Seal_Header;
+
+#define PROVISION_HEADER 0 //gathering the image header
+#define PROVISION_ENTRY 1 //gathering an automaton's entry
+#define PROVISION_TABLE 2 //filling an automaton's table
+#define PROVISION_DONE 3 //every table is full, nothing more may follow
+
+typedef struct{ //an encrypted set arriving in chunks, see beginProvision
+    int active;
+    uint8_t nonce[8];
+    uint32_t index; //next chunk expected
+    int phase; //PROVISION_HEADER .. PROVISION_DONE
+    uint8_t hold[sizeof(dfa_image_entry_t)]; //header or entry gathered across chunk boundaries
+    uint32_t held;
+    dfa_image_header_t header;
+    Packed_Dfa* packed[MAX_PATTERNS];
+    int count; //automata allocated so far
+    int patterns;
+    size_t tableOff; //bytes of the current table filled so far
+    uint64_t received; //plaintext bytes so far
+} Provision_State;
+
+extern Packed_Dfa* dfaSet[MAX_PATTERNS];
+extern int numDfas;
+extern int numPatterns;
+extern int setVersion;
 
 int nextPowerOfTwo(unsigned int num);
+void selectRow(uint64_t* out, const uint64_t* table, int rows, int rowWords, int index); //constant-time copy of table row index into out
+void selectRows(uint64_t* out, const uint64_t* table, int rows, int rowWords, const int* index, int count); //selectRow for count indices in one pass
+#if !defined(DFA_UNTRUSTED)
 void printf(const char *fmt, ...);
+#endif
 
+int stageDFA(Staged_Dfa* dfa, int rows); //allocate unpadded tables for rows states at full width
+void freeStagedDFA(Staged_Dfa* dfa);
+int compressAlphabet(Staged_Dfa* dfa); //merge equivalent input bytes into classes, returns the number of classes
+int minimizeDFA(Staged_Dfa* dfa); //Hopcroft minimization, returns the new number of states
+int shrinkDFA(Staged_Dfa* dfa); //compress, minimize and compress again, returns the number of states
+int productDFA(const Staged_Dfa* a, const Staged_Dfa* b, Staged_Dfa* out); //automaton running a and b together
+int stateTier(int rows); //smallest of STATE_TIERS holding rows states
+int classTier(int classes); //smallest of CLASS_TIERS holding classes columns
+int scanCost(const Staged_Dfa* dfa); //words read per input byte once padded
+Packed_Dfa* newDFA(int tier, int numClasses, int acceptBits); //empty packed automaton of the given shape
+Packed_Dfa* padDFA(const Staged_Dfa* dfa); //pad and pack a staged DFA to its tier
+void freeOram(Path_Oram* oram); //free an ORAM's levels, leaving its shape fields
+void freeDFA(Packed_Dfa* dfa);
+void dfaEntry(const Packed_Dfa* dfa, dfa_image_entry_t* entry); //shape and class map of a packed automaton
+Packed_Dfa* entryDFA(const dfa_image_entry_t* entry); //empty packed automaton an entry describes, NULL if inconsistent
+int stagePatterns(const char* patterns, Staged_Dfa* dfas); //compile and shrink newline-separated regexes, -1 or DFA_TOO_LARGE on failure
+int packDFASet(Staged_Dfa* dfas, int count, Packed_Dfa** packed); //pack, merging automata into products where they fit
+void lockSet(int exclusive); //hold the loaded set shared to scan it, or exclusively to replace or rebuild it
+void unlockSet(int exclusive);
+//the loaders below (prepDFASet, loadDFAImage, useDFASet, unsealDFASet and provisionChunk) replace the loaded set only
+//when they succeed; when one fails it returns -1 and the set loaded before it keeps running
+void installDFASet(Packed_Dfa** packed, int count); //replace the loaded set with packed automata, set lock held exclusively
+int loadDFASet(Staged_Dfa* dfas, int count); //replace the loaded set with staged automata
+int getTier(); //number of states the largest loaded DFA is padded to
 int prepDFA(); //prepare DFA for reading in (only needs to be run once)
-int initDFA(); //start up or reboot the DFA
-int opOram(int index, Oram_Block* block, int write);
-void sortStash(int startIndex, int size, int flipped);
-void mergeStash(int startIndex, int size, int flipped);
-int opDFA(char input); //return >=1 if accepting state, 0 otherwise
-int runDFA(char* data, int length); //return last op output
+int prepDFASet(const char* patterns); //compile newline-separated regexes, returns the number of patterns
+int loadDFAImage(const uint8_t* image, size_t length); //load a set compiled by dfac, returns the number of patterns
+size_t dfaBytes(const Packed_Dfa* dfa); //memory a packed automaton holds with its ORAM
+int cacheFind(const uint8_t* digest); //handle of the cached set with this pattern digest, or -1
+int cacheSlot(int handle); //cache slot of a live handle, or -1
+int lruEntry(); //least recently used cached set that may be evicted, or -1
+void chargeEntry(int slot); //recount a cached set's memory after its ORAMs were rebuilt
+void evictEntry(int slot); //free a cached set
+int cacheDFASet(const char* patterns); //compile and cache a set unless it is cached already, returns its handle
+int useDFASet(int handle); //load a cached set, returns the number of patterns
+int dfaParts(Packed_Dfa* dfa, uint8_t** parts, size_t* sizes); //memory sealed for an automaton, SEAL_PARTS pieces
+int sealRecords(Packed_Dfa** dfas, int count); //records sealing a set takes
+int sealRecord(Seal_Aad* aad, const uint8_t* data, uint32_t size, sgx_sealed_data_t* sealed); //seal and save one record
+int sealDFASet(); //seal the loaded set with its ORAMs out through ocall_save_sealed, returns the number of records
+int unsealRecord(const uint8_t* blob, size_t length, size_t* off, sgx_sealed_data_t* stage, Seal_Aad* aad,
+    uint8_t* out, uint32_t size); //unseal the next record of a blob
+int unsealDFASet(const uint8_t* blob, size_t length); //restore a sealed set, returns the number of patterns
+int setProvisionKey(const uint8_t* key); //AES-128 key encrypted sets are provisioned under
+int beginProvision(const uint8_t* nonce); //start receiving an encrypted set
+void abortProvision(); //drop a set being provisioned
+void dropProvision(); //abortProvision with provisionMutex already held
+int provisionBytes(const uint8_t* data, uint32_t length); //parse decrypted image bytes into the set being provisioned
+int provisionChunk(const uint8_t* chunk, uint32_t length, const uint8_t* mac, int last); //decrypt and load one chunk
+int64_t oramCost(int numBlocks, int blockSize, int scheme); //estimated picoseconds of one ORAM access, position map included
+int64_t posMapCost(int numBlocks, int scheme); //estimated picoseconds to look up and move a leaf in a position map
+int recursePosMap(int numBlocks, int scheme); //whether a position map is kept in a smaller ORAM rather than scanned
+int oramShape(int numBlocks, int scheme, int* blocks, int* nodes); //blocks and buckets of each ORAM level, returns the levels
+int bucketSlots(int scheme); //blocks a bucket of scheme holds
+int allocOram(Packed_Dfa* dfa); //allocate one automaton's ORAM
+int resetOram(Path_Oram* oram); //empty one level and the levels under it, with blocks on random leaves
+int initOram(Packed_Dfa* dfa); //set up or reset one automaton's ORAM
+int fillOram(Packed_Dfa* dfa); //write one automaton's table into its ORAM, allocating it if need be
+int initDFA(); //start up or reboot the DFAs
+int64_t rowCost(const Packed_Dfa* dfa, int backend); //estimated picoseconds to fetch one row with backend
+int backendScheme(int backend); //ORAM scheme of an ORAM backend
+int cheapestBackend(const Packed_Dfa* dfa, int first); //backend from first on that rowCost rates cheapest
+int chooseBackend(Packed_Dfa* dfa); //set how opDFA fetches the automaton's rows, returns the backend
+int setBackend(int mode); //DFA_BACKEND_AUTO, _SCAN, _ORAM, _CIRCUIT or _RING for every automaton, returns how many use an ORAM
+void fetchRow(Packed_Dfa* dfa, int state, uint64_t* out); //copy row state into out with the automaton's backend
+int opOram(Path_Oram* oram, int index, Oram_Block* block, int write);
+unsigned int remapOram(Path_Oram* oram, int index, unsigned int newLeaf); //leaf of block index, moving it to newLeaf
+unsigned int accessOram(Path_Oram* oram, int index, Oram_Block* block, int write, int slot, unsigned int value);
+unsigned int swapLeaf(Oram_Block* block, int match, int slot, unsigned int value); //position map slot update
+unsigned int evictPath(Path_Oram* oram); //next eviction path, in reverse lexicographic order
+int reachLevel(unsigned int leaf, unsigned int path, int depth); //deepest level on path a block on leaf may sit at
+Oram_Block* ringBucket(Path_Oram* oram, int node); //the RING_SLOTS slots of a Ring ORAM bucket
+void readBucket(Path_Oram* oram, int node, Oram_Block* out); //the real blocks of a Ring ORAM bucket, BUCKET_SIZE of them
+void writeBucket(Path_Oram* oram, int node, const Oram_Block* in); //rewrite a Ring ORAM bucket with in, freshly permuted
+void compactStash(Path_Oram* oram); //move the stash's real blocks to its front, obliviously
+int opDFA(Packed_Dfa* dfa, int* state, char input); //advance state, return its accept mask
+void getStates(int* states); //copy out each loaded automaton's runDFA state, set lock held
+void putStates(const int* states); //leave states as the runDFA states, set lock held
+int runDFA(char* data, int length); //return position of the first match of any pattern
+int scanDFA(int* states, const char* data, int length); //runDFA from states under a set lock the caller holds
+int runDFAMulti(char* data, int length, int* accLocs, int maxPatterns); //first match of each pattern
+int opDFABatch(Packed_Dfa* dfa, int* states, const char* inputs, int count, int* masks); //opDFA for up to MAX_BATCH streams
+int runDFABatch(char* data, int length, int count, int* accLocs); //first match in each of count equal-length documents
+int enumDFA(Packed_Dfa* dfa, const char* data, int length, int* ends, int* firsts); //run data from every state at once, -1 if out of memory
+void runChunk(int chunk); //simulate one chunk of the parallel job for every automaton
+void workChunks(); //take chunks of the parallel job until none are left
+int runDFAParallel(char* data, int length, int numWorkers); //runDFA split over numWorkers threads and the caller
+int runDFAWorker(); //lend the calling thread to the next runDFAParallel
+int openSession(); //start a stream against the loaded set, returns its handle
+int feedSession(int session, char* data, int length); //scan the next chunk of the stream
+void scanSession(Session* sn, const char* data, int length); //advance a session over trusted data
+int finalizeSession(int session, int64_t* accLocs, int maxPatterns, int64_t* accLoc); //first matches, then close
+int runDFAUntrusted(char* data, int length); //runDFA on a buffer left in untrusted memory
+int feedSessionUntrusted(int session, char* data, int length); //feedSession on a buffer left in untrusted memory
+int64_t hotcallRun(char* data, int length); //first match in an untrusted buffer, run from the start states
+int64_t hotcallDo(hotcall_request_t* req); //run one ring request, returns its result
+int hotcallServe(hotcall_ring_t* ring); //serve a request ring until it is stopped
 
 #if defined(__cplusplus)
 }
+
+template<int Depth> struct Oram_Tree{ //shape of an ORAM tree Depth levels deep, fixed at compile time
+    enum{ leaves = 1 << (Depth-1), nodes = 2*leaves-1 };
+    typedef char pathFitsStash[(Depth*BUCKET_SIZE <= STASH_SPACE) ? 1 : -1]; //pathAccess and evictRing read a path into the stash's front half
+    static int node(unsigned int leaf, int level){ //bucket at level (root 1) of the path to leaf
+        return ((leaves+leaf) >> (Depth-level)) - 1;
+    }
+};
+
+//accessOram and the schemes under it, compiled once for each tree depth up to MAX_TREE_DEPTH
+template<int Depth> unsigned int accessDepth(Path_Oram* oram, int index, Oram_Block* block, int write, int slot, unsigned int value);
+template<int Depth> unsigned int pathAccess(Path_Oram* oram, int index, Oram_Block* block, int write, int slot, unsigned int value);
+template<int Depth> Oram_Block* pathLevel(Path_Oram* oram, unsigned int leaf, int level, int* slots); //stash (level 0) or bucket on a path
+template<int Depth> unsigned int circuitAccess(Path_Oram* oram, int index, Oram_Block* block, int write, int slot, unsigned int value);
+template<int Depth> void evictCircuit(Path_Oram* oram, unsigned int path); //one Circuit ORAM eviction along path
+template<int Depth> unsigned int ringAccess(Path_Oram* oram, int index, Oram_Block* block, int write, int slot, unsigned int value);
+template<int Depth> void evictRing(Path_Oram* oram, unsigned int path); //one Ring ORAM eviction along path
 #endif
 
 #endif /* !_ENCLAVE_H_ */
@@ -0,0 +1,214 @@
+#ifndef _OBLIVIOUS_H_
+#define _OBLIVIOUS_H_
+
+#include <stdint.h>
+
+//Constant-time primitives shared by the DFA and ORAM code. Each one reads and writes all of its operands and picks
+//with masks (all ones or all zeros, see ctMask), never with a branch or an address that depends on what it picks,
+//so this file is the place to audit that the enclave does not show which row, block, slot or class it took.
+//Blocks and rows are moved through __builtin_memcpy, which may alias the int fields of an Oram_Block: first in
+//vectors of VEC_BYTES, then in 64-bit words. Tables are scanned in vectors whose lanes are compared with the index.
+
+#if defined(__AVX2__)
+#define VEC_BYTES 32 //256-bit vectors when the enclave is built with AVX2
+#else
+#define VEC_BYTES 16 //128 bits is baseline on x86-64
+#endif
+#define VEC_WORDS (VEC_BYTES/(int)sizeof(uint64_t))
+
+typedef uint64_t Vec __attribute__((vector_size(VEC_BYTES))); //64-bit lanes: blocks, rows, word tables
+typedef int Vec32 __attribute__((vector_size(VEC_BYTES))); //32-bit lanes: int tables
+typedef uint8_t Vec8 __attribute__((vector_size(VEC_BYTES))); //8-bit lanes: the class map
+
+static inline uint64_t ctMask(int cond){ //all ones if cond is 1, all zeros if it is 0
+    return -(uint64_t)cond;
+}
+
+static inline int selectInt(int cond, int a, int b){ //a if cond is 1, b if it is 0
+    return b ^ ((a ^ b) & -cond);
+}
+
+static inline uint64_t selectWord(uint64_t mask, uint64_t a, uint64_t b){ //a where mask is set, b elsewhere
+    return b ^ ((a ^ b) & mask);
+}
+
+static inline int firstHit(int first, int hit, int at){ //at if hit is 1 and nothing was found yet (first is -1)
+    return selectInt(hit & (first == -1), at, first);
+}
+
+static inline void condCopy(void* dst, const void* src, int words, uint64_t mask){ //copy 64-bit words where mask is set
+    uint8_t* d = (uint8_t*)dst;
+    const uint8_t* s = (const uint8_t*)src;
+    int w = 0;
+    for(; w+VEC_WORDS <= words; w += VEC_WORDS){
+        Vec x, y;
+        __builtin_memcpy(&x, d+w*sizeof(uint64_t), sizeof(Vec));
+        __builtin_memcpy(&y, s+w*sizeof(uint64_t), sizeof(Vec));
+        x ^= (x ^ y) & mask;
+        __builtin_memcpy(d+w*sizeof(uint64_t), &x, sizeof(Vec));
+    }
+    for(; w < words; w++){
+        uint64_t x, y;
+        __builtin_memcpy(&x, d+w*sizeof(uint64_t), sizeof(uint64_t));
+        __builtin_memcpy(&y, s+w*sizeof(uint64_t), sizeof(uint64_t));
+        x = selectWord(mask, y, x);
+        __builtin_memcpy(d+w*sizeof(uint64_t), &x, sizeof(uint64_t));
+    }
+}
+
+static inline void condSwap(void* a, void* b, int words, uint64_t mask){ //swap 64-bit words where mask is set
+    uint8_t* p = (uint8_t*)a;
+    uint8_t* q = (uint8_t*)b;
+    int w = 0;
+    for(; w+VEC_WORDS <= words; w += VEC_WORDS){
+        Vec x, y;
+        __builtin_memcpy(&x, p+w*sizeof(uint64_t), sizeof(Vec));
+        __builtin_memcpy(&y, q+w*sizeof(uint64_t), sizeof(Vec));
+        Vec t = (x ^ y) & mask;
+        x ^= t;
+        y ^= t;
+        __builtin_memcpy(p+w*sizeof(uint64_t), &x, sizeof(Vec));
+        __builtin_memcpy(q+w*sizeof(uint64_t), &y, sizeof(Vec));
+    }
+    for(; w < words; w++){
+        uint64_t x, y;
+        __builtin_memcpy(&x, p+w*sizeof(uint64_t), sizeof(uint64_t));
+        __builtin_memcpy(&y, q+w*sizeof(uint64_t), sizeof(uint64_t));
+        uint64_t t = (x ^ y) & mask;
+        x ^= t;
+        y ^= t;
+        __builtin_memcpy(p+w*sizeof(uint64_t), &x, sizeof(uint64_t));
+        __builtin_memcpy(q+w*sizeof(uint64_t), &y, sizeof(uint64_t));
+    }
+}
+
+static inline void condOr(void* dst, const void* src, int words, uint64_t mask){ //or in 64-bit words where mask is set
+    //a zeroed dst that every candidate is or-ed into, each with its own mask, ends up holding the one selected
+    uint8_t* d = (uint8_t*)dst;
+    const uint8_t* s = (const uint8_t*)src;
+    int w = 0;
+    for(; w+VEC_WORDS <= words; w += VEC_WORDS){
+        Vec x, y;
+        __builtin_memcpy(&x, d+w*sizeof(uint64_t), sizeof(Vec));
+        __builtin_memcpy(&y, s+w*sizeof(uint64_t), sizeof(Vec));
+        x |= y & mask;
+        __builtin_memcpy(d+w*sizeof(uint64_t), &x, sizeof(Vec));
+    }
+    for(; w < words; w++){
+        uint64_t x, y;
+        __builtin_memcpy(&x, d+w*sizeof(uint64_t), sizeof(uint64_t));
+        __builtin_memcpy(&y, s+w*sizeof(uint64_t), sizeof(uint64_t));
+        x |= y & mask;
+        __builtin_memcpy(d+w*sizeof(uint64_t), &x, sizeof(uint64_t));
+    }
+}
+
+static inline uint64_t lookupWord(const uint64_t* table, int n, int index){ //table[index], reading all n entries
+    //both 32-bit halves of a 64-bit lane hold its index, so the lane masks come from a 32-bit compare, which
+    //SSE2 has; a 64-bit one (SSE4.1) would otherwise be split into scalar compares
+    const int lanes = VEC_BYTES/sizeof(uint64_t);
+    Vec32 lane;
+    Vec acc;
+    uint64_t out = 0;
+    int i = 0;
+    for(int k = 0; k < 2*lanes; k++) lane[k] = k/2;
+    for(int k = 0; k < lanes; k++) acc[k] = 0;
+    for(; i+lanes <= n; i += lanes){
+        Vec v;
+        __builtin_memcpy(&v, table+i, sizeof(Vec));
+        acc |= v & (Vec)(lane == index);
+        lane += lanes;
+    }
+    for(int k = 0; k < lanes; k++) out |= acc[k];
+    for(; i < n; i++) out |= table[i] & ctMask(i == index);
+    return out;
+}
+
+static inline int lookupInt(const int* table, int n, int index){ //table[index], reading all n entries
+    const int lanes = VEC_BYTES/sizeof(int);
+    Vec32 lane, acc;
+    int out = 0;
+    int i = 0;
+    for(int k = 0; k < lanes; k++){
+        lane[k] = k;
+        acc[k] = 0;
+    }
+    for(; i+lanes <= n; i += lanes){
+        Vec32 v;
+        __builtin_memcpy(&v, table+i, sizeof(Vec32));
+        acc |= v & (lane == index);
+        lane += lanes;
+    }
+    for(int k = 0; k < lanes; k++) out |= acc[k];
+    for(; i < n; i++) out |= table[i] & -(i == index);
+    return out;
+}
+
+static inline int lookupByte(const uint8_t* table, int n, int index){ //table[index], reading all n entries, n at most 256
+    const int lanes = VEC_BYTES;
+    Vec8 lane, acc;
+    int out = 0;
+    int i = 0;
+    for(int k = 0; k < lanes; k++){
+        lane[k] = k;
+        acc[k] = 0;
+    }
+    for(; i+lanes <= n; i += lanes){
+        Vec8 v;
+        __builtin_memcpy(&v, table+i, sizeof(Vec8));
+        acc |= v & (Vec8)(lane == (uint8_t)index);
+        lane += (uint8_t)lanes;
+    }
+    for(int k = 0; k < lanes; k++) out |= acc[k];
+    for(; i < n; i++) out |= table[i] & -(i == index);
+    return out;
+}
+
+static inline uint64_t selectField(const uint64_t* words, int numWords, int perWord, int bits, int index){
+    //field index of fields packed perWord to a word, bits wide from the low end, reading every field of every word
+    uint64_t fieldMask = ((uint64_t)1 << bits) - 1;
+    uint64_t out = 0;
+    int i = 0;
+    for(int w = 0; w < numWords; w++){
+        uint64_t word = words[w];
+        for(int f = 0; f < perWord; f++, i++){
+            out |= word & fieldMask & ctMask(i == index);
+            word >>= bits;
+        }
+    }
+    return out;
+}
+
+static inline unsigned int exchangeUint(void* table, int n, int index, unsigned int value, int cond){
+    //if cond is 1, put value in entry index of the n unsigned ints at table and return what was there, otherwise
+    //return 0 and leave the table as it was; every entry is rewritten either way
+    const int lanes = VEC_BYTES/sizeof(int);
+    uint8_t* t = (uint8_t*)table;
+    Vec32 lane, acc;
+    unsigned int old = 0;
+    int i = 0;
+    for(int k = 0; k < lanes; k++){
+        lane[k] = k;
+        acc[k] = 0;
+    }
+    for(; i+lanes <= n; i += lanes){
+        Vec32 v, pick = (lane == index) & -cond;
+        __builtin_memcpy(&v, t+i*sizeof(int), sizeof(Vec32));
+        acc |= v & pick;
+        v ^= (v ^ (int)value) & pick;
+        __builtin_memcpy(t+i*sizeof(int), &v, sizeof(Vec32));
+        lane += lanes;
+    }
+    for(int k = 0; k < lanes; k++) old |= acc[k];
+    for(; i < n; i++){
+        unsigned int pick = -(unsigned int)(cond & (i == index));
+        unsigned int entry;
+        __builtin_memcpy(&entry, t+i*sizeof(unsigned int), sizeof(entry));
+        old |= entry & pick;
+        entry ^= (entry ^ value) & pick;
+        __builtin_memcpy(t+i*sizeof(unsigned int), &entry, sizeof(entry));
+    }
+    return old;
+}
+
+#endif /* !_OBLIVIOUS_H_ */
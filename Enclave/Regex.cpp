@@ -0,0 +1,445 @@
+#include "Regex.h"
+
+//Regex compiler: pattern -> Thompson NFA -> subset construction -> staged rows for shrinkDFA and padDFA
+//supported: literals, . (any byte), [...] and [^...] with ranges, escapes (\n \t \r \f \v \0 \xHH \d \w \s
+//\D \W \S and escaped metacharacters), grouping, |, *, +, ? and {m}, {m,}, {m,n}. A leading ^ anchors the
+//pattern at the start of the input, otherwise it matches anywhere. Patterns are compiled from bytes the enclave
+//holds, before any input is seen, so none of this is oblivious; it is bounded by MAX_NFA_STATES and the largest tier
+
+static int newNode(Regex_Parser* p, int type){
+    if(p->numNodes == MAX_NFA_STATES){
+        p->error = 1;
+        return 0;
+    }
+    Nfa_Node* n = &p->nodes[p->numNodes];
+    n->type = type;
+    n->out = -1;
+    n->out2 = -1;
+    memset(n->set, 0, sizeof(n->set));
+    return p->numNodes++;
+}
+
+static void addByte(uint64_t* set, int c){
+    set[c >> 6] |= (uint64_t)1 << (c & 63);
+}
+
+static void addRange(uint64_t* set, int lo, int hi){
+    for(int c = lo; c <= hi; c++) addByte(set, c);
+}
+
+static Nfa_Fragment emptyFragment(Regex_Parser* p){
+    Nfa_Fragment f;
+    f.start = newNode(p, NODE_EPS);
+    f.end = f.start;
+    return f;
+}
+
+static Nfa_Fragment setFragment(Regex_Parser* p, const uint64_t* set){
+    Nfa_Fragment f;
+    f.start = newNode(p, NODE_SET);
+    f.end = newNode(p, NODE_EPS);
+    memcpy(p->nodes[f.start].set, set, sizeof(p->nodes[f.start].set));
+    p->nodes[f.start].out = f.end;
+    return f;
+}
+
+static Nfa_Fragment concat(Regex_Parser* p, Nfa_Fragment a, Nfa_Fragment b){
+    p->nodes[a.end].out = b.start;
+    a.end = b.end;
+    return a;
+}
+
+static Nfa_Fragment optional(Regex_Parser* p, Nfa_Fragment a){ //a?
+    Nfa_Fragment f;
+    f.start = newNode(p, NODE_EPS);
+    f.end = newNode(p, NODE_EPS);
+    p->nodes[f.start].out = a.start;
+    p->nodes[f.start].out2 = f.end;
+    p->nodes[a.end].out = f.end;
+    return f;
+}
+
+static Nfa_Fragment star(Regex_Parser* p, Nfa_Fragment a){ //a*
+    Nfa_Fragment f;
+    f.start = newNode(p, NODE_EPS);
+    f.end = newNode(p, NODE_EPS);
+    p->nodes[f.start].out = a.start;
+    p->nodes[f.start].out2 = f.end;
+    p->nodes[a.end].out = f.start;
+    return f;
+}
+
+static int hexDigit(int c){
+    if(c >= '0' && c <= '9') return c-'0';
+    if(c >= 'a' && c <= 'f') return c-'a'+10;
+    if(c >= 'A' && c <= 'F') return c-'A'+10;
+    return -1;
+}
+
+static int parseEscape(Regex_Parser* p, uint64_t* set){
+    //the byte after a backslash; adds what it stands for to set. Returns the byte for a single-byte escape
+    //(so it can start a range in a class), -1 for a shorthand class
+    if(p->pos == p->length){
+        p->error = 1;
+        return -1;
+    }
+    int c = (uint8_t)p->pattern[p->pos++];
+    uint64_t cls[4] = {0, 0, 0, 0};
+    int shorthand = 0, negate = (c == 'D' || c == 'W' || c == 'S');
+    switch(c){
+        case 'n': c = '\n'; break;
+        case 't': c = '\t'; break;
+        case 'r': c = '\r'; break;
+        case 'f': c = '\f'; break;
+        case 'v': c = '\v'; break;
+        case '0': c = 0; break;
+        case 'x':{
+            int hi = (p->pos+1 < p->length) ? hexDigit(p->pattern[p->pos]) : -1;
+            int lo = (hi != -1) ? hexDigit(p->pattern[p->pos+1]) : -1;
+            if(lo == -1){
+                p->error = 1;
+                return -1;
+            }
+            p->pos += 2;
+            c = hi*16+lo;
+            break;
+        }
+        case 'd': case 'D':
+            addRange(cls, '0', '9');
+            shorthand = 1;
+            break;
+        case 'w': case 'W':
+            addRange(cls, '0', '9');
+            addRange(cls, 'a', 'z');
+            addRange(cls, 'A', 'Z');
+            addByte(cls, '_');
+            shorthand = 1;
+            break;
+        case 's': case 'S':
+            addByte(cls, ' ');
+            addRange(cls, '\t', '\r');
+            shorthand = 1;
+            break;
+        default:
+            break; //any other escaped byte stands for itself
+    }
+    if(shorthand){
+        for(int i = 0; i < 4; i++) set[i] |= negate ? ~cls[i] : cls[i];
+        return -1;
+    }
+    addByte(set, c);
+    return c;
+}
+
+static Nfa_Fragment parseClass(Regex_Parser* p){
+    //after '[': bytes, ranges and escapes up to ']'; a ']' right after '[' or '[^' is a literal
+    uint64_t set[4] = {0, 0, 0, 0};
+    int negate = 0, first = 1;
+    if(p->pos < p->length && p->pattern[p->pos] == '^'){
+        negate = 1;
+        p->pos++;
+    }
+    while(p->pos < p->length && (first || p->pattern[p->pos] != ']')){
+        int lo = (uint8_t)p->pattern[p->pos++];
+        first = 0;
+        if(lo == '\\'){
+            lo = parseEscape(p, set);
+            if(lo == -1) continue;
+        }
+        else{
+            addByte(set, lo);
+        }
+        if(p->pos+1 < p->length && p->pattern[p->pos] == '-' && p->pattern[p->pos+1] != ']'){
+            p->pos++;
+            uint64_t dummy[4] = {0, 0, 0, 0};
+            int hi = (uint8_t)p->pattern[p->pos++];
+            if(hi == '\\') hi = parseEscape(p, dummy);
+            if(hi < lo){
+                p->error = 1;
+                break;
+            }
+            addRange(set, lo, hi);
+        }
+    }
+    if(p->pos == p->length){ //no closing ']'
+        p->error = 1;
+        return emptyFragment(p);
+    }
+    p->pos++;
+    if(negate){
+        for(int i = 0; i < 4; i++) set[i] = ~set[i];
+    }
+    return setFragment(p, set);
+}
+
+static Nfa_Fragment parseAlternation(Regex_Parser* p);
+
+static Nfa_Fragment parseAtom(Regex_Parser* p){
+    uint64_t set[4] = {0, 0, 0, 0};
+    int c = (uint8_t)p->pattern[p->pos++];
+    if(c == '('){
+        Nfa_Fragment f = parseAlternation(p);
+        if(p->pos == p->length || p->pattern[p->pos] != ')') p->error = 1;
+        else p->pos++;
+        return f;
+    }
+    if(c == '[') return parseClass(p);
+    if(c == '.'){
+        for(int i = 0; i < 4; i++) set[i] = ~(uint64_t)0;
+        return setFragment(p, set);
+    }
+    if(c == '\\'){
+        parseEscape(p, set);
+        return setFragment(p, set);
+    }
+    if(c == '*' || c == '+' || c == '?' || c == '{' || c == '$' || c == '^'){ //nothing to repeat, or unsupported
+        p->error = 1;
+        return emptyFragment(p);
+    }
+    addByte(set, c);
+    return setFragment(p, set);
+}
+
+static int parseCount(Regex_Parser* p){
+    int n = -1;
+    while(p->pos < p->length && p->pattern[p->pos] >= '0' && p->pattern[p->pos] <= '9' && n <= MAX_REPEAT){
+        n = (n == -1 ? 0 : n*10) + (p->pattern[p->pos++]-'0');
+    }
+    return n;
+}
+
+static Nfa_Fragment parseRepeat(Regex_Parser* p){
+    //an atom and its quantifiers; {m,n} needs fresh copies of the atom, so its text is parsed again for each
+    int atomStart = p->pos;
+    Nfa_Fragment f = parseAtom(p);
+    int quantified = 0;
+    while(p->pos < p->length && !p->error){
+        char q = p->pattern[p->pos];
+        if(q == '*'){
+            f = star(p, f);
+        }
+        else if(q == '+'){
+            f = concat(p, f, star(p, f)); //the loop reuses f's nodes, so no copy is needed
+        }
+        else if(q == '?'){
+            f = optional(p, f);
+        }
+        else if(q == '{'){
+            if(quantified){ //a*{2}: the atom text no longer describes f
+                p->error = 1;
+                break;
+            }
+            p->pos++;
+            int lo = parseCount(p), hi = lo;
+            if(p->pos < p->length && p->pattern[p->pos] == ','){
+                p->pos++;
+                hi = parseCount(p); //-1: no upper bound
+            }
+            if(p->pos == p->length || p->pattern[p->pos] != '}' || lo < 0 || lo > MAX_REPEAT || hi > MAX_REPEAT || (hi != -1 && hi < lo)){
+                p->error = 1;
+                break;
+            }
+            int close = p->pos;
+            int copies = (hi == -1) ? lo+1 : hi;
+            Nfa_Fragment r = emptyFragment(p);
+            for(int i = 0; i < copies && !p->error; i++){
+                Nfa_Fragment a = f;
+                if(i > 0){
+                    p->pos = atomStart;
+                    a = parseAtom(p);
+                }
+                if(i < lo) r = concat(p, r, a);
+                else if(hi == -1) r = concat(p, r, star(p, a));
+                else r = concat(p, r, optional(p, a));
+            }
+            f = r;
+            p->pos = close;
+        }
+        else{
+            break;
+        }
+        quantified = 1;
+        p->pos++;
+    }
+    return f;
+}
+
+static Nfa_Fragment parseConcatenation(Regex_Parser* p){
+    Nfa_Fragment f = emptyFragment(p);
+    while(p->pos < p->length && p->pattern[p->pos] != '|' && p->pattern[p->pos] != ')' && !p->error){
+        f = concat(p, f, parseRepeat(p));
+    }
+    return f;
+}
+
+static Nfa_Fragment parseAlternation(Regex_Parser* p){
+    Nfa_Fragment f = parseConcatenation(p);
+    while(p->pos < p->length && p->pattern[p->pos] == '|' && !p->error){
+        p->pos++;
+        Nfa_Fragment g = parseConcatenation(p);
+        Nfa_Fragment alt;
+        alt.start = newNode(p, NODE_EPS);
+        alt.end = newNode(p, NODE_EPS);
+        p->nodes[alt.start].out = f.start;
+        p->nodes[alt.start].out2 = g.start;
+        p->nodes[f.end].out = alt.end;
+        p->nodes[g.end].out = alt.end;
+        f = alt;
+    }
+    return f;
+}
+
+static void closure(const Nfa_Node* nodes, uint64_t* set, int* stack, int numWords){
+    //add every node reachable from set without reading a byte
+    int top = 0;
+    for(int w = 0; w < numWords; w++){
+        for(int b = 0; b < 64; b++){
+            if(set[w] >> b & 1) stack[top++] = w*64+b;
+        }
+    }
+    while(top > 0){
+        const Nfa_Node* n = &nodes[stack[--top]];
+        if(n->type != NODE_EPS) continue;
+        int outs[2] = {n->out, n->out2};
+        for(int k = 0; k < 2; k++){
+            int t = outs[k];
+            if(t != -1 && !(set[t >> 6] >> (t & 63) & 1)){
+                set[t >> 6] |= (uint64_t)1 << (t & 63);
+                stack[top++] = t;
+            }
+        }
+    }
+}
+
+int compileRegex(Staged_Dfa* dfa, const char* pattern, int length){
+    //compile a regex into dfa at full width with one accept bit, ready for shrinkDFA. Accepting states keep
+    //accepting on every byte since only the first match is reported, which also lets them all merge into one
+    //returns 0, DFA_TOO_LARGE if the NFA or the DFA outgrows its bound, or -1 on a syntax error or if out of memory
+    int maxStates = STATE_TIERS[NUM_STATE_TIERS-1];
+    int hashSize = 2*nextPowerOfTwo(maxStates);
+    int anchored = (length > 0 && pattern[0] == '^');
+    int ret = 0, n = 0, numClasses = 0, numWords, start, match;
+    int byteClass[256], rep[256];
+    uint64_t *sets = NULL, *next = NULL;
+    int *stack = NULL, *keys = NULL;
+    uint16_t* trans = NULL;
+    Regex_Parser p;
+    Nfa_Fragment f;
+    p.pattern = pattern;
+    p.length = length;
+    p.pos = anchored;
+    p.error = 0;
+    p.numNodes = 0;
+    p.nodes = (Nfa_Node*)malloc(MAX_NFA_STATES*sizeof(Nfa_Node));
+    if(!p.nodes) return -1;
+
+    f = parseAlternation(&p);
+    match = newNode(&p, NODE_MATCH);
+    if(p.error && p.numNodes == MAX_NFA_STATES){ //newNode only fails once every node is taken
+        printf("regex needs more than %d NFA nodes\n", MAX_NFA_STATES);
+        ret = DFA_TOO_LARGE;
+        goto done;
+    }
+    if(p.error || p.pos != length){ //a stray ')' stops the parse early
+        printf("regex error at byte %d of pattern\n", p.pos);
+        ret = -1;
+        goto done;
+    }
+    p.nodes[f.end].out = match;
+    start = f.start;
+    numWords = (p.numNodes+63)/64;
+
+    //bytes every NODE_SET treats alike form one class, so subsets are only stepped once per class
+    for(int c = 0; c < 256; c++) byteClass[c] = 0;
+    numClasses = 1;
+    for(int i = 0; i < p.numNodes; i++){
+        if(p.nodes[i].type != NODE_SET) continue;
+        int split[512]; //(old class, in set) -> new class
+        int count = 0;
+        for(int k = 0; k < 512; k++) split[k] = -1;
+        for(int c = 0; c < 256; c++){
+            int key = byteClass[c]*2 + (int)(p.nodes[i].set[c >> 6] >> (c & 63) & 1);
+            if(split[key] == -1) split[key] = count++;
+            byteClass[c] = split[key];
+        }
+        numClasses = count;
+    }
+    for(int c = 255; c >= 0; c--) rep[byteClass[c]] = c;
+
+    sets = (uint64_t*)malloc((size_t)maxStates*numWords*sizeof(uint64_t)); //NFA subset of each DFA state
+    next = (uint64_t*)malloc(numWords*sizeof(uint64_t));
+    stack = (int*)malloc(p.numNodes*sizeof(int));
+    keys = (int*)malloc(hashSize*sizeof(int)); //DFA state in each hash slot, -1 if empty
+    trans = (uint16_t*)malloc((size_t)maxStates*numClasses*sizeof(uint16_t));
+    if(!sets || !next || !stack || !keys || !trans){
+        ret = -1;
+        goto done;
+    }
+    for(int h = 0; h < hashSize; h++) keys[h] = -1;
+
+    //subset construction, breadth first from the closure of the start node
+    memset(next, 0, numWords*sizeof(uint64_t));
+    next[start >> 6] |= (uint64_t)1 << (start & 63);
+    for(int i = -1; i < n && ret == 0; i++){
+        for(int k = 0; k < numClasses && ret == 0; k++){
+            if(i >= 0){
+                const uint64_t* cur = &sets[(size_t)i*numWords];
+                if(cur[match >> 6] >> (match & 63) & 1){ //accepting: stay
+                    trans[i*numClasses+k] = i;
+                    continue;
+                }
+                int c = rep[k];
+                memset(next, 0, numWords*sizeof(uint64_t));
+                if(!anchored) next[start >> 6] |= (uint64_t)1 << (start & 63); //a match can begin at any byte
+                for(int w = 0; w < numWords; w++){
+                    for(int b = 0; b < 64; b++){
+                        if(!(cur[w] >> b & 1)) continue;
+                        const Nfa_Node* nd = &p.nodes[w*64+b];
+                        if(nd->type == NODE_SET && (nd->set[c >> 6] >> (c & 63) & 1)){
+                            next[nd->out >> 6] |= (uint64_t)1 << (nd->out & 63);
+                        }
+                    }
+                }
+            }
+            closure(p.nodes, next, stack, numWords);
+
+            //find or add the subset
+            uint64_t hash = 14695981039346656037ull;
+            for(int w = 0; w < numWords; w++) hash = (hash ^ next[w]) * 1099511628211ull;
+            int h = (int)(hash & (hashSize-1)), found = -1;
+            while(keys[h] != -1 && found == -1){
+                if(memcmp(&sets[(size_t)keys[h]*numWords], next, numWords*sizeof(uint64_t)) == 0) found = keys[h];
+                else h = (h+1) & (hashSize-1);
+            }
+            if(found == -1){
+                if(n == maxStates){
+                    printf("regex needs more than %d states\n", maxStates);
+                    ret = DFA_TOO_LARGE;
+                    break;
+                }
+                memcpy(&sets[(size_t)n*numWords], next, numWords*sizeof(uint64_t));
+                keys[h] = n;
+                found = n++;
+            }
+            if(i == -1) break; //the start state only needed adding
+            trans[i*numClasses+k] = found;
+        }
+    }
+    if(ret != 0) goto done;
+
+    //emit full-width rows, shrinkDFA folds the classes back together
+    if(stageDFA(dfa, n) != 0){
+        ret = -1;
+        goto done;
+    }
+    for(int s = 0; s < n; s++){
+        for(int c = 0; c < 256; c++){
+            dfa->rows[s*256+c] = trans[s*numClasses+byteClass[c]];
+        }
+        dfa->accStates[s] = (int)(sets[(size_t)s*numWords+(match >> 6)] >> (match & 63) & 1);
+    }
+
+done:
+    free(p.nodes); free(sets); free(next); free(stack); free(keys); free(trans);
+    return ret;
+}
@@ -0,0 +1,44 @@
+#ifndef _REGEX_H_
+#define _REGEX_H_
+
+#include "Enclave.h"
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+#define MAX_NFA_STATES 2048 //nodes in one pattern's Thompson NFA; bounds the compiler's memory with the largest tier (else DFA_TOO_LARGE)
+#define MAX_REPEAT 255 //largest count in a {m,n} repetition
+
+#define NODE_EPS 0 //moves on to out, and to out2 if it is set, without reading a byte
+#define NODE_SET 1 //reads one byte in set and moves on to out
+#define NODE_MATCH 2 //the pattern has matched
+
+typedef struct{
+    int type;
+    int out;
+    int out2; //-1 unless the node is a split
+    uint64_t set[4]; //256-bit byte set of a NODE_SET
+} Nfa_Node;
+
+typedef struct{ //a piece of NFA under construction: start node and a NODE_EPS end whose out is not set yet
+    int start;
+    int end;
+} Nfa_Fragment;
+
+typedef struct{
+    const char* pattern;
+    int length;
+    int pos;
+    int error; //set on the first syntax error or when MAX_NFA_STATES runs out
+    Nfa_Node* nodes;
+    int numNodes;
+} Regex_Parser;
+
+int compileRegex(Staged_Dfa* dfa, const char* pattern, int length); //stage the search DFA for a regex
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif /* !_REGEX_H_ */
@@ -32,9 +32,102 @@
 
 /* User defined types */
 
+#ifndef _USER_TYPES_H_
+#define _USER_TYPES_H_
 
 #define LOOPS_PER_THREAD 500
 
 typedef void *buffer_t;
 typedef int array_t[10];
 
+
+/* HotCall request ring, shared by the App and enclave workers running hotcallServe */
+
+#include <stdint.h>
+
+#define HOTCALL_SLOTS 64
+
+#define HOTCALL_FREE 0 //slot can be claimed by the App
+#define HOTCALL_CLAIMED 1 //App is filling in the request
+#define HOTCALL_POSTED 2 //request is waiting for a worker
+#define HOTCALL_TAKEN 3 //a worker is running it
+#define HOTCALL_DONE 4 //result is ready, the App frees the slot once it has read it
+
+#define HOTCALL_RUN 0 //scan data from the start states, result is the first match or -1
+#define HOTCALL_OPEN 1 //openSession, result is the handle
+#define HOTCALL_FEED 2 //feedSession(session, data, length)
+#define HOTCALL_FINALIZE 3 //finalizeSession; data is NULL or int64_t[length] for the per-pattern matches, result is the first match
+
+typedef struct {
+    volatile int status; //HOTCALL_FREE .. HOTCALL_DONE
+    int op;
+    int session;
+    int length;
+    char *data; //untrusted memory, read in place
+    volatile int64_t result;
+} hotcall_request_t;
+
+typedef struct {
+    hotcall_request_t slots[HOTCALL_SLOTS];
+    volatile int next; //slot the App tries to claim next
+    volatile int stop; //set by the App to make the workers return
+} hotcall_ring_t;
+
+
+/* Automaton set image, written by dfac and loaded with loadDFAImage
+ * layout: dfa_image_header_t, then numDfas times a dfa_image_entry_t followed by its numStates*rowWords
+ * little-endian table words, packed exactly as Packed_Dfa holds them. Every part is a multiple of 8 bytes,
+ * so a mapped image keeps its tables aligned */
+
+#define DFA_IMAGE_MAGIC 0x41464453 //"SDFA"
+#define DFA_IMAGE_VERSION 1
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t numDfas;
+    uint32_t numPatterns; //accept bits over all automata
+    uint64_t size; //bytes in the whole image
+    uint8_t hash[32]; //SHA-256 of the whole image with this field zeroed
+} dfa_image_header_t;
+
+typedef struct {
+    uint32_t numStates; //state tier
+    uint32_t numClasses; //class tier, the row width in entries
+    uint32_t stateBits;
+    uint32_t acceptBits; //patterns this automaton reports on; its accept masks are packed into the table entries
+    uint32_t entryBits;
+    uint32_t entriesPerWord;
+    uint32_t rowWords;
+    uint32_t reserved; //0
+    uint8_t classMap[256];
+} dfa_image_entry_t;
+
+/* Encrypted automaton set, for provisioning a set the host must not read: a dfac image sent as AES-128-GCM
+ * chunks of at most PROVISION_CHUNK bytes. dfac -k writes the 8-byte stream nonce, then for each chunk a
+ * dfa_chunk_header_t and its ciphertext. Chunk i is sealed with IV nonce || i (32-bit little-endian) and its
+ * header's last field as 4 bytes of AAD, so chunks cannot be reordered, dropped or cut short unnoticed */
+
+#define PROVISION_CHUNK 65536
+
+typedef struct {
+    uint32_t length; //ciphertext bytes, at most PROVISION_CHUNK
+    uint32_t last; //1 on the final chunk
+    uint8_t mac[16]; //GCM tag
+} dfa_chunk_header_t;
+
+/* How the enclave fetches a row of an automaton's table on each step, passed to setBackend */
+
+#define DFA_BACKEND_AUTO 0 //pick per automaton whichever is cheapest for its tier and row width
+#define DFA_BACKEND_SCAN 1 //linear scan of the whole table
+#define DFA_BACKEND_ORAM 2 //one Path ORAM access
+#define DFA_BACKEND_CIRCUIT 3 //one Circuit ORAM access
+#define DFA_BACKEND_RING 4 //one Ring ORAM access
+
+/* What prepDFASet and cacheDFASet return instead of a pattern count or handle when a set cannot be compiled;
+ * the loaded set is left as it was */
+
+#define DFA_LOAD_FAILED -1 //a pattern is malformed, there are none or more than MAX_PATTERNS, or memory ran out
+#define DFA_TOO_LARGE -2 //a pattern needs more than MAX_NFA_STATES NFA nodes or more DFA states than the largest tier
+
+#endif /* !_USER_TYPES_H_ */
@@ -0,0 +1,161 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+
+#include "sgx_trts.h"
+#include "sgx_tseal.h"
+#include "sgx_tcrypto.h"
+#include "Enclave_t.h"
+#include "Runtime.h"
+
+//the parts of the SGX runtime the enclave sources use, for running them untrusted in dfatest: randomness and
+//SHA-256 from OpenSSL, sealing as AES-128-GCM under a key drawn once per process, and the App's three ocalls
+
+std::string sealedSet;
+int failSaves = 0;
+static unsigned char sealKey[16];
+static int haveSealKey = 0;
+
+static int gcm(int encrypt, const uint8_t* key, const uint8_t* iv, const uint8_t* aad, uint32_t aadLength,
+    const uint8_t* in, uint32_t length, uint8_t* out, uint8_t* tag){
+    //AES-128-GCM over in into out with aad authenticated; tag is written when encrypting, checked when decrypting
+    EVP_CIPHER_CTX* ctx = EVP_CIPHER_CTX_new();
+    int n = 0;
+    int ok = ctx && EVP_CipherInit_ex(ctx, EVP_aes_128_gcm(), NULL, key, iv, encrypt) == 1
+        && EVP_CipherUpdate(ctx, NULL, &n, aad, aadLength) == 1
+        && EVP_CipherUpdate(ctx, out, &n, in, length) == 1
+        && (encrypt || EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG, 16, tag) == 1)
+        && EVP_CipherFinal_ex(ctx, out+n, &n) == 1
+        && (!encrypt || EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG, 16, tag) == 1);
+    EVP_CIPHER_CTX_free(ctx);
+    return ok ? 0 : -1;
+}
+
+extern "C" {
+
+sgx_status_t sgx_read_rand(unsigned char* rand, size_t length){
+    return RAND_bytes(rand, length) == 1 ? SGX_SUCCESS : SGX_ERROR_UNEXPECTED;
+}
+
+int sgx_is_outside_enclave(const void* addr, size_t size){
+    (void)addr;
+    (void)size;
+    return 1;
+}
+
+uint32_t sgx_calc_sealed_data_size(uint32_t add_mac_txt_size, uint32_t txt_encrypt_size){
+    return sizeof(sgx_sealed_data_t)+add_mac_txt_size+txt_encrypt_size;
+}
+
+uint32_t sgx_get_add_mac_txt_len(const sgx_sealed_data_t* p_sealed_data){
+    return p_sealed_data->payload_size-p_sealed_data->plain_text_offset;
+}
+
+uint32_t sgx_get_encrypt_txt_len(const sgx_sealed_data_t* p_sealed_data){
+    return p_sealed_data->plain_text_offset;
+}
+
+sgx_status_t sgx_seal_data_ex(uint16_t key_policy, sgx_attributes_t attribute_mask, uint32_t misc_mask,
+    uint32_t additional_MACtext_length, const uint8_t* p_additional_MACtext, uint32_t text2encrypt_length,
+    const uint8_t* p_text2encrypt, uint32_t sealed_data_size, sgx_sealed_data_t* p_sealed_data){
+    (void)key_policy;
+    (void)attribute_mask;
+    (void)misc_mask;
+    if(sealed_data_size != sgx_calc_sealed_data_size(additional_MACtext_length, text2encrypt_length)){
+        return SGX_ERROR_INVALID_PARAMETER;
+    }
+    if(!haveSealKey){
+        if(RAND_bytes(sealKey, sizeof(sealKey)) != 1) return SGX_ERROR_UNEXPECTED;
+        haveSealKey = 1;
+    }
+    sgx_sealed_data_t* s = p_sealed_data;
+    s->plain_text_offset = text2encrypt_length;
+    s->payload_size = text2encrypt_length+additional_MACtext_length;
+    if(RAND_bytes(s->iv, sizeof(s->iv)) != 1) return SGX_ERROR_UNEXPECTED;
+    memcpy(s->payload+text2encrypt_length, p_additional_MACtext, additional_MACtext_length);
+    if(gcm(1, sealKey, s->iv, p_additional_MACtext, additional_MACtext_length, p_text2encrypt, text2encrypt_length,
+        s->payload, s->payload_tag) != 0) return SGX_ERROR_UNEXPECTED;
+    return SGX_SUCCESS;
+}
+
+sgx_status_t sgx_unseal_data(const sgx_sealed_data_t* p_sealed_data, uint8_t* p_additional_MACtext,
+    uint32_t* p_additional_MACtext_length, uint8_t* p_decrypted_text, uint32_t* p_decrypted_text_length){
+    const sgx_sealed_data_t* s = p_sealed_data;
+    uint32_t macSize = sgx_get_add_mac_txt_len(s), textSize = sgx_get_encrypt_txt_len(s);
+    uint8_t tag[16];
+    if(s->plain_text_offset > s->payload_size || macSize > *p_additional_MACtext_length
+        || textSize > *p_decrypted_text_length) return SGX_ERROR_INVALID_PARAMETER;
+    if(!haveSealKey) return SGX_ERROR_MAC_MISMATCH;
+    memcpy(tag, s->payload_tag, sizeof(tag));
+    if(gcm(0, sealKey, s->iv, s->payload+textSize, macSize, s->payload, textSize, p_decrypted_text, tag) != 0){
+        return SGX_ERROR_MAC_MISMATCH;
+    }
+    memcpy(p_additional_MACtext, s->payload+textSize, macSize);
+    *p_additional_MACtext_length = macSize;
+    *p_decrypted_text_length = textSize;
+    return SGX_SUCCESS;
+}
+
+sgx_status_t sgx_sha256_msg(const uint8_t* p_src, uint32_t src_len, sgx_sha256_hash_t* p_hash){
+    return EVP_Digest(p_src, src_len, *p_hash, NULL, EVP_sha256(), NULL) == 1 ? SGX_SUCCESS : SGX_ERROR_UNEXPECTED;
+}
+
+sgx_status_t sgx_sha256_init(sgx_sha_state_handle_t* p_sha_handle){
+    EVP_MD_CTX* ctx = EVP_MD_CTX_new();
+    if(!ctx || EVP_DigestInit_ex(ctx, EVP_sha256(), NULL) != 1){
+        EVP_MD_CTX_free(ctx);
+        return SGX_ERROR_UNEXPECTED;
+    }
+    *p_sha_handle = ctx;
+    return SGX_SUCCESS;
+}
+
+sgx_status_t sgx_sha256_update(const uint8_t* p_src, uint32_t src_len, sgx_sha_state_handle_t sha_handle){
+    return EVP_DigestUpdate((EVP_MD_CTX*)sha_handle, p_src, src_len) == 1 ? SGX_SUCCESS : SGX_ERROR_UNEXPECTED;
+}
+
+sgx_status_t sgx_sha256_get_hash(sgx_sha_state_handle_t sha_handle, sgx_sha256_hash_t* p_hash){
+    return EVP_DigestFinal_ex((EVP_MD_CTX*)sha_handle, *p_hash, NULL) == 1 ? SGX_SUCCESS : SGX_ERROR_UNEXPECTED;
+}
+
+sgx_status_t sgx_sha256_close(sgx_sha_state_handle_t sha_handle){
+    EVP_MD_CTX_free((EVP_MD_CTX*)sha_handle);
+    return SGX_SUCCESS;
+}
+
+sgx_status_t sgx_rijndael128GCM_decrypt(const sgx_aes_gcm_128bit_key_t* p_key, const uint8_t* p_src, uint32_t src_len,
+    uint8_t* p_dst, const uint8_t* p_iv, uint32_t iv_len, const uint8_t* p_aad, uint32_t aad_len,
+    const sgx_aes_gcm_128bit_tag_t* p_in_mac){
+    uint8_t tag[16];
+    if(iv_len != 12) return SGX_ERROR_INVALID_PARAMETER;
+    memcpy(tag, *p_in_mac, sizeof(tag));
+    return gcm(0, *p_key, p_iv, p_aad, aad_len, p_src, src_len, p_dst, tag) == 0 ? SGX_SUCCESS : SGX_ERROR_MAC_MISMATCH;
+}
+
+sgx_status_t SGX_CDECL ocall_print_string(const char* str){
+    printf("%s", str);
+    return SGX_SUCCESS;
+}
+
+sgx_status_t SGX_CDECL ocall_hotcall_idle(void){
+    usleep(50);
+    return SGX_SUCCESS;
+}
+
+sgx_status_t SGX_CDECL ocall_save_sealed(int* retval, const uint8_t* record, uint32_t length, uint32_t index){
+    //as App.cpp's, into sealedSet instead of a file
+    if(index == 0) sealedSet.clear();
+    if(failSaves > 0){
+        failSaves--;
+        *retval = -1;
+        return SGX_SUCCESS;
+    }
+    sealedSet.append((const char*)&length, sizeof(length));
+    sealedSet.append((const char*)record, length);
+    *retval = 0;
+    return SGX_SUCCESS;
+}
+
+}
@@ -0,0 +1,11 @@
+#ifndef _RUNTIME_H_
+#define _RUNTIME_H_
+
+#include <string>
+
+//Tests/Runtime.cpp: what dfatest links in place of the SGX runtime and the App's ocalls
+
+extern std::string sealedSet; //records of the last sealDFASet, each after its uint32 length as App.cpp stores them
+extern int failSaves; //ocall_save_sealed refuses this many more records
+
+#endif
@@ -0,0 +1,405 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+#include <regex>
+#include <random>
+#include <thread>
+#include <unistd.h>
+
+#include "Enclave.h"
+#include "Runtime.h"
+
+//dfatest: the enclave sources built as untrusted code (see Tests/sgx) and checked against std::regex
+//usage: dfatest <dfac>
+//each pattern is compiled alone and in one set, and every scan entry point is run over the set on every backend,
+//each first match compared with where std::regex finds it. Sealed sets, dfac images and provisioned sets are
+//loaded back whole and then tampered with, which must leave the loaded set running. Prints every mismatch and
+//exits 1 if there was any
+
+static const char* PATTERNS[] = {
+    "D.?A.?R.?P.?A", "O.?L", "a[bc]+d", "[^a-z ]{3}", "(ab|ba)*c", "x{2,4}y", "\\d+\\.\\d", "\\w\\s\\w",
+    "^abc", "(a|b)(c|d)?e", "[0-9a-f]{4}", "b{3}", "ca?t+", "\\x41B", "(xy){2,}", "[\\]a]B",
+    "[A-Z][a-z]", "e.?e", "(D|O)(A|L)", "1{1,}0", "[\\d.]{3,}", "_\\W", "t(a|e)?x", "(a|xy|Dd)+B{1,2}A"
+};
+#define NUM_PATTERNS (int)(sizeof(PATTERNS)/sizeof(PATTERNS[0]))
+static const char* EDGE_PATTERNS[] = {"a*", "(ab)?", "^D", "^.{5}", ".", "[^x]", "\\.\\*"}; //checked alone
+#define NUM_EDGE_PATTERNS (int)(sizeof(EDGE_PATTERNS)/sizeof(EDGE_PATTERNS[0]))
+static const char* OTHER_PATTERNS = "hflk\nD.?L.?L"; //a second set, loaded while a tampered one is refused
+#define NUM_TEXTS 40
+#define TEXT_LENGTH 160 //every text is this long, so runDFABatch needs no padding
+#define SESSION_PIECE 37 //bytes per feedSession call
+
+static const int BACKENDS[] = {DFA_BACKEND_AUTO, DFA_BACKEND_SCAN, DFA_BACKEND_ORAM, DFA_BACKEND_CIRCUIT, DFA_BACKEND_RING};
+static const char* BACKEND_NAMES[] = {"auto", "scan", "Path ORAM", "Circuit ORAM", "Ring ORAM"};
+
+static std::vector<std::string> texts;
+static std::vector<std::vector<int> > expected; //expected[t][p]: first match of PATTERNS[p] in texts[t]
+static int failures = 0;
+
+static void expect(const char* what, int want, int got){
+    if(want == got) return;
+    printf("FAIL %s: expected %d, got %d\n", what, want, got);
+    failures++;
+}
+
+static int firstMatch(const std::string& pattern, const std::string& text){
+    //where the enclave reports pattern's first match in text: the byte that ends the match ending earliest, or -1.
+    //A match of the empty string ends before the first byte, which is as early as a scan can report it. Both
+    //match anywhere unless the pattern starts with ^; the $ pins each regex_search to the end of a prefix
+    std::regex re("(?:" + pattern + ")$");
+    for(size_t end = 0; end <= text.size(); end++){
+        if(std::regex_search(text.begin(), text.begin()+end, re)) return text.empty() ? -1 : (end == 0 ? 0 : (int)end-1);
+    }
+    return -1;
+}
+
+static int earliest(const std::vector<int>& locs){
+    int first = -1;
+    for(size_t p = 0; p < locs.size(); p++){
+        if(locs[p] != -1 && (first == -1 || locs[p] < first)) first = locs[p];
+    }
+    return first;
+}
+
+static void makeTexts(){
+    //random bytes from a small alphabet, with pieces that match some of the patterns dropped into most texts
+    static const char alphabet[] = "abcdexyDARPOL019 ._A]Bt";
+    static const char* pieces[] = {"DARPA", "DxAxRPyA", "OL", "abbcd", "xxxy", "12.3", "a b", "ace", "cat",
+        "AB", "bbb", "beef", "xyxyx", "]B", "Ob", "110", "t_", "tax", "DdxyBB"};
+    std::mt19937 rng(1);
+    for(int t = 0; t < NUM_TEXTS; t++){
+        std::string text(TEXT_LENGTH, ' ');
+        for(int i = 0; i < TEXT_LENGTH; i++) text[i] = alphabet[rng() % (sizeof(alphabet)-1)];
+        if(t % 5 != 0){
+            const char* piece = pieces[rng() % (sizeof(pieces)/sizeof(pieces[0]))];
+            text.replace(rng() % (TEXT_LENGTH-8), strlen(piece), piece);
+        }
+        if(t % 7 == 0) text.replace(0, 3, "abc");
+        texts.push_back(text);
+    }
+    expected.resize(NUM_TEXTS);
+    for(int t = 0; t < NUM_TEXTS; t++){
+        for(int p = 0; p < NUM_PATTERNS; p++) expected[t].push_back(firstMatch(PATTERNS[p], texts[t]));
+    }
+}
+
+static std::string joinPatterns(){
+    std::string all;
+    for(int p = 0; p < NUM_PATTERNS; p++) all += std::string(PATTERNS[p]) + "\n";
+    return all;
+}
+
+static int readFile(const std::string& name, std::string* out){
+    FILE* f = fopen(name.c_str(), "rb");
+    if(!f) return -1;
+    char buf[4096];
+    size_t n;
+    while((n = fread(buf, 1, sizeof(buf), f)) > 0) out->append(buf, n);
+    int ret = ferror(f) ? -1 : 0;
+    fclose(f);
+    return ret;
+}
+
+static int writeFile(const std::string& name, const std::string& data){
+    FILE* f = fopen(name.c_str(), "wb");
+    if(!f) return -1;
+    int ret = (fwrite(data.data(), 1, data.size(), f) == data.size()) ? 0 : -1;
+    if(fclose(f) != 0) ret = -1;
+    return ret;
+}
+
+static void checkMulti(const char* what, int t){
+    //runDFAMulti on texts[t] from the start states
+    int accLocs[MAX_PATTERNS];
+    std::string text = texts[t];
+    initDFA();
+    expect(what, NUM_PATTERNS, runDFAMulti(&text[0], text.size(), accLocs, MAX_PATTERNS));
+    for(int p = 0; p < NUM_PATTERNS; p++){
+        if(accLocs[p] != expected[t][p]){
+            printf("FAIL %s: pattern %s in text %d: expected %d, got %d\n", what, PATTERNS[p], t, expected[t][p], accLocs[p]);
+            failures++;
+        }
+    }
+}
+
+static void checkScans(const char* what, int step){
+    //every scan entry point on every step-th text and runDFABatch on them all, each against the first matches
+    //std::regex finds
+    std::string name;
+    for(int t = 0; t < NUM_TEXTS; t += step){
+        std::string text = texts[t];
+        int first = earliest(expected[t]);
+        checkMulti((name = std::string(what) + " runDFAMulti").c_str(), t);
+        initDFA();
+        expect((name = std::string(what) + " runDFA").c_str(), first, runDFA(&text[0], text.size()));
+        initDFA();
+        expect((name = std::string(what) + " runDFAUntrusted").c_str(), first, runDFAUntrusted(&text[0], text.size()));
+
+        //a session fed in pieces, alternately copied in and read in place
+        int64_t accLocs[MAX_PATTERNS], accLoc = -1;
+        int session = openSession();
+        int ret = (session == -1) ? -1 : 0;
+        for(int off = 0; off < (int)text.size() && ret == 0; off += SESSION_PIECE){
+            int n = ((int)text.size()-off < SESSION_PIECE) ? (int)text.size()-off : SESSION_PIECE;
+            ret = (off/SESSION_PIECE % 2) ? feedSessionUntrusted(session, &text[off], n) : feedSession(session, &text[off], n);
+        }
+        name = std::string(what) + " session";
+        expect(name.c_str(), 0, ret);
+        expect(name.c_str(), NUM_PATTERNS, finalizeSession(session, accLocs, MAX_PATTERNS, &accLoc));
+        expect(name.c_str(), first, (int)accLoc);
+        for(int p = 0; p < NUM_PATTERNS; p++) expect(name.c_str(), expected[t][p], (int)accLocs[p]);
+
+        //runDFAParallel with up to 3 workers besides this thread
+        int numWorkers = t/step % 4;
+        std::vector<std::thread> workers;
+        initDFA();
+        for(int i = 0; i < numWorkers; i++) workers.push_back(std::thread(runDFAWorker));
+        int got = runDFAParallel(&text[0], text.size(), numWorkers);
+        for(int i = 0; i < numWorkers; i++) workers[i].join();
+        expect((name = std::string(what) + " runDFAParallel").c_str(), first, got);
+    }
+
+    //every text in one batch, MAX_BATCH at a time
+    std::string all;
+    int accLocs[NUM_TEXTS];
+    for(int t = 0; t < NUM_TEXTS; t++) all += texts[t];
+    name = std::string(what) + " runDFABatch";
+    expect(name.c_str(), 0, runDFABatch(&all[0], TEXT_LENGTH, NUM_TEXTS, accLocs));
+    for(int t = 0; t < NUM_TEXTS; t++) expect(name.c_str(), earliest(expected[t]), accLocs[t]);
+}
+
+static void checkCompiler(){
+    //each pattern alone, scanned over every text in one batch, then malformed and oversized ones, which must
+    //leave the loaded set in place
+    std::string name, all;
+    int accLocs[NUM_TEXTS];
+    for(int t = 0; t < NUM_TEXTS; t++) all += texts[t];
+    for(int p = 0; p < NUM_PATTERNS+NUM_EDGE_PATTERNS; p++){
+        const char* pattern = (p < NUM_PATTERNS) ? PATTERNS[p] : EDGE_PATTERNS[p-NUM_PATTERNS];
+        name = std::string("compile ") + pattern;
+        expect(name.c_str(), 1, prepDFASet(pattern));
+        expect(name.c_str(), 0, runDFABatch(&all[0], TEXT_LENGTH, NUM_TEXTS, accLocs));
+        for(int t = 0; t < NUM_TEXTS; t++) expect(name.c_str(), firstMatch(pattern, texts[t]), accLocs[t]);
+    }
+    char empty = 0;
+    initDFA();
+    expect("empty input", -1, runDFA(&empty, 0));
+
+    static const char* malformed[] = {"ab(c", "a)", "*a", "a{3,2}", "[ab", "a\\", "x{256}", "a$", "\n\n"};
+    for(size_t i = 0; i < sizeof(malformed)/sizeof(malformed[0]); i++){
+        name = std::string("malformed ") + malformed[i];
+        expect(name.c_str(), DFA_LOAD_FAILED, prepDFASet(malformed[i]));
+        expect(name.c_str(), 1, getTier() > 0 ? 1 : 0);
+    }
+    std::string words; //300 six-letter words: more NFA nodes than MAX_NFA_STATES
+    std::mt19937 rng(2);
+    for(int w = 0; w < 300; w++){
+        words += w ? "|" : "";
+        for(int c = 0; c < 6; c++) words += (char)('a' + rng() % 26);
+    }
+    expect("too many NFA nodes", DFA_TOO_LARGE, prepDFASet(words.c_str()));
+    expect("too many DFA states", DFA_TOO_LARGE, prepDFASet("[ab]*a[ab]{14}"));
+    expect("too large to cache", DFA_TOO_LARGE, cacheDFASet(words.c_str()));
+    std::string tooMany;
+    for(int p = 0; p <= MAX_PATTERNS; p++) tooMany += "a\n";
+    expect("more than MAX_PATTERNS", DFA_LOAD_FAILED, prepDFASet(tooMany.c_str()));
+    std::string text = texts[0];
+    initDFA();
+    expect("set kept after failed loads", firstMatch(EDGE_PATTERNS[NUM_EDGE_PATTERNS-1], text), runDFA(&text[0], text.size()));
+}
+
+static void checkCache(){
+    int accLocs[MAX_PATTERNS];
+    std::string all = joinPatterns();
+    int other = cacheDFASet(OTHER_PATTERNS), full = cacheDFASet(all.c_str());
+    expect("cache handles", 1, other >= 0 && full >= 0 && other != full);
+    expect("cache hit", full, cacheDFASet(all.c_str()));
+    expect("useDFASet other", 2, useDFASet(other));
+    expect("useDFASet other", 2, runDFAMulti(&texts[0][0], TEXT_LENGTH, accLocs, MAX_PATTERNS));
+    expect("useDFASet full", NUM_PATTERNS, useDFASet(full));
+    checkMulti("cached set", 1);
+    expect("useDFASet bad handle", -1, useDFASet(-1));
+}
+
+static std::vector<std::string> splitRecords(const std::string& blob){
+    std::vector<std::string> records;
+    for(size_t off = 0; off+sizeof(uint32_t) <= blob.size();){
+        uint32_t length;
+        memcpy(&length, &blob[off], sizeof(length));
+        records.push_back(blob.substr(off, sizeof(length)+length));
+        off += sizeof(length)+length;
+    }
+    return records;
+}
+
+static void expectRefused(const char* what, int got){
+    //a tampered load must fail and leave OTHER_PATTERNS, loaded just before, running
+    int accLocs[MAX_PATTERNS];
+    expect(what, -1, got);
+    expect(what, 2, runDFAMulti(&texts[0][0], TEXT_LENGTH, accLocs, MAX_PATTERNS));
+}
+
+static void checkSeal(){
+    std::string all = joinPatterns();
+    for(int b = 2; b < 5; b++){ //the ORAM backends: the scheme and its stash, tree and counters are all sealed
+        std::string name = std::string("seal ") + BACKEND_NAMES[b];
+        int accLocs[MAX_PATTERNS];
+        setBackend(BACKENDS[b]);
+        expect(name.c_str(), NUM_PATTERNS, prepDFASet(all.c_str()));
+        initDFA();
+        runDFAMulti(&texts[2][0], TEXT_LENGTH, accLocs, MAX_PATTERNS); //moves blocks around the ORAMs
+        int records = sealDFASet();
+        std::string blob = sealedSet;
+        expect(name.c_str(), records, (int)splitRecords(blob).size());
+
+        //the restored set starts from the start states on the ORAMs as sealed, without initDFA
+        expect(name.c_str(), 2, prepDFASet(OTHER_PATTERNS));
+        expect(name.c_str(), NUM_PATTERNS, unsealDFASet((const uint8_t*)blob.data(), blob.size()));
+        runDFAMulti(&texts[3][0], TEXT_LENGTH, accLocs, MAX_PATTERNS);
+        for(int p = 0; p < NUM_PATTERNS; p++) expect((name + " restored").c_str(), expected[3][p], accLocs[p]);
+        checkMulti(name.c_str(), 4);
+
+        //a second seal of the same set has its own set id, so records cannot be mixed between the two
+        expect(name.c_str(), records, sealDFASet());
+        std::vector<std::string> mine = splitRecords(blob), theirs = splitRecords(sealedSet);
+        expect(name.c_str(), 2, prepDFASet(OTHER_PATTERNS));
+        for(size_t at = 4; at < blob.size(); at += blob.size()/7){
+            std::string bad = blob;
+            bad[at] ^= 1;
+            expectRefused((name + " flipped byte").c_str(), unsealDFASet((const uint8_t*)bad.data(), bad.size()));
+        }
+        std::string bad = blob.substr(0, blob.size()-1);
+        expectRefused((name + " truncated").c_str(), unsealDFASet((const uint8_t*)bad.data(), bad.size()));
+        bad = blob.substr(0, blob.size()-mine.back().size());
+        expectRefused((name + " last record dropped").c_str(), unsealDFASet((const uint8_t*)bad.data(), bad.size()));
+        bad = blob + mine.back();
+        expectRefused((name + " record repeated").c_str(), unsealDFASet((const uint8_t*)bad.data(), bad.size()));
+        bad = theirs[0];
+        for(size_t r = 1; r < mine.size(); r++) bad += mine[r];
+        expectRefused((name + " records mixed").c_str(), unsealDFASet((const uint8_t*)bad.data(), bad.size()));
+        if(mine.size() > 2){
+            bad = mine[0] + mine[2] + mine[1];
+            for(size_t r = 3; r < mine.size(); r++) bad += mine[r];
+            expectRefused((name + " records reordered").c_str(), unsealDFASet((const uint8_t*)bad.data(), bad.size()));
+        }
+        failSaves = 1;
+        expect((name + " save fails").c_str(), -1, sealDFASet());
+    }
+    setBackend(DFA_BACKEND_AUTO);
+}
+
+static void checkImages(const char* dfac, const std::string& dir){
+    //an image and an encrypted image of the whole set, both written by dfac
+    std::string patterns = dir + "/patterns", image = dir + "/image", encrypted = dir + "/encrypted", keyFile = dir + "/key";
+    std::string key(16, '\0'), data, sealedData;
+    sgx_read_rand((unsigned char*)&key[0], key.size());
+    std::string command = std::string(dfac) + " " + patterns + " " + image + " > /dev/null && "
+        + dfac + " -k " + keyFile + " " + patterns + " " + encrypted + " > /dev/null";
+    if(writeFile(patterns, joinPatterns()) != 0 || writeFile(keyFile, key) != 0 || system(command.c_str()) != 0
+        || readFile(image, &data) != 0 || readFile(encrypted, &sealedData) != 0){
+        printf("FAIL cannot run %s\n", command.c_str());
+        failures++;
+        return;
+    }
+
+    expect("image", NUM_PATTERNS, loadDFAImage((const uint8_t*)data.data(), data.size()));
+    for(int t = 0; t < NUM_TEXTS; t++) checkMulti("image", t);
+    expect("image", 2, prepDFASet(OTHER_PATTERNS));
+    for(size_t at = 0; at < data.size(); at += data.size()/5+1){
+        std::string bad = data;
+        bad[at] ^= 0x10;
+        expectRefused("image flipped byte", loadDFAImage((const uint8_t*)bad.data(), bad.size()));
+    }
+    std::string bad = data.substr(0, data.size()-1);
+    expectRefused("image truncated", loadDFAImage((const uint8_t*)bad.data(), bad.size()));
+
+    //provisioned as App.cpp's provisionFile sends it: the nonce, then each chunk with its header
+    setProvisionKey((const uint8_t*)key.data());
+    std::vector<size_t> chunks; //offset of each chunk header
+    for(size_t off = 8; off+sizeof(dfa_chunk_header_t) <= sealedData.size();){
+        dfa_chunk_header_t chunk;
+        memcpy(&chunk, &sealedData[off], sizeof(chunk));
+        chunks.push_back(off);
+        off += sizeof(chunk)+chunk.length;
+    }
+    struct Provisioner{
+        static int send(const std::string& stream, const std::vector<size_t>& chunks, size_t count){
+            int ret = beginProvision((const uint8_t*)stream.data());
+            for(size_t c = 0; c < count && ret == 0; c++){
+                dfa_chunk_header_t chunk;
+                memcpy(&chunk, &stream[chunks[c]], sizeof(chunk));
+                ret = provisionChunk((const uint8_t*)&stream[chunks[c]+sizeof(chunk)], chunk.length, chunk.mac, chunk.last);
+            }
+            return ret;
+        }
+    };
+    expect("provision", NUM_PATTERNS, Provisioner::send(sealedData, chunks, chunks.size()));
+    for(int t = 0; t < NUM_TEXTS; t++) checkMulti("provision", t);
+    expect("provision", 2, prepDFASet(OTHER_PATTERNS));
+    for(size_t c = 0; c < chunks.size(); c++){
+        std::string stream = sealedData;
+        stream[chunks[c]+sizeof(dfa_chunk_header_t)+c*7 % 64] ^= 1; //a ciphertext byte
+        expectRefused("provision flipped byte", Provisioner::send(stream, chunks, chunks.size()));
+        stream = sealedData;
+        stream[chunks[c]+offsetof(dfa_chunk_header_t, mac)] ^= 1;
+        expectRefused("provision flipped MAC", Provisioner::send(stream, chunks, chunks.size()));
+    }
+    std::string stream = sealedData;
+    stream[0] ^= 1; //the nonce
+    expectRefused("provision changed nonce", Provisioner::send(stream, chunks, chunks.size()));
+    stream = sealedData;
+    dfa_chunk_header_t last;
+    memcpy(&last, &stream[chunks.back()], sizeof(last));
+    last.last = !last.last;
+    memcpy(&stream[chunks.back()], &last, sizeof(last));
+    expectRefused("provision last flag changed", Provisioner::send(stream, chunks, chunks.size()));
+    int accLocs[MAX_PATTERNS];
+    expect("provision cut short", 0, chunks.size() > 1 ? Provisioner::send(sealedData, chunks, chunks.size()-1) : 0);
+    expect("provision cut short", 2, runDFAMulti(&texts[0][0], TEXT_LENGTH, accLocs, MAX_PATTERNS));
+    if(chunks.size() > 1){
+        std::vector<size_t> swapped = chunks;
+        std::swap(swapped[0], swapped[1]);
+        expectRefused("provision chunks reordered", Provisioner::send(sealedData, swapped, swapped.size()));
+    }
+    expect("chunk without beginProvision", -1, provisionChunk((const uint8_t*)&sealedData[chunks[0]+sizeof(dfa_chunk_header_t)],
+        16, (const uint8_t*)&sealedData[chunks[0]+offsetof(dfa_chunk_header_t, mac)], 0));
+    key[0] ^= 1;
+    setProvisionKey((const uint8_t*)key.data());
+    expectRefused("provision wrong key", Provisioner::send(sealedData, chunks, chunks.size()));
+}
+
+int main(int argc, char* argv[])
+{
+    if(argc != 2){
+        fprintf(stderr, "usage: %s <dfac>\n", argv[0]);
+        return 1;
+    }
+    char dir[] = "/tmp/dfatestXXXXXX";
+    if(!mkdtemp(dir)){
+        fprintf(stderr, "cannot make a temporary directory\n");
+        return 1;
+    }
+    makeTexts();
+
+    checkCompiler();
+    std::string all = joinPatterns();
+    expect("prepDFASet", NUM_PATTERNS, prepDFASet(all.c_str()));
+    for(int b = 0; b < 5; b++){
+        expect(BACKEND_NAMES[b], 0, setBackend(BACKENDS[b]) < 0 ? -1 : 0);
+        checkScans(BACKEND_NAMES[b], BACKENDS[b] >= DFA_BACKEND_ORAM ? 4 : 1); //an ORAM access costs far more than a scan
+    }
+    setBackend(DFA_BACKEND_AUTO);
+    checkCache();
+    checkSeal();
+    checkImages(argv[1], dir);
+
+    std::string cleanup = std::string("rm -rf ") + dir;
+    if(system(cleanup.c_str()) != 0) fprintf(stderr, "cannot remove %s\n", dir);
+    if(failures){
+        printf("dfatest: %d failures\n", failures);
+        return 1;
+    }
+    printf("dfatest: %d patterns on %d texts agree with std::regex on every backend\n", NUM_PATTERNS, NUM_TEXTS);
+    return 0;
+}
@@ -0,0 +1,22 @@
+#ifndef ENCLAVE_T_H__
+#define ENCLAVE_T_H__
+
+//stand-in for the trusted bridge sgx_edger8r generates from Enclave.edl: the ocalls the enclave sources make,
+//implemented by Tests/Runtime.cpp. The ecalls are plain functions declared in Enclave.h
+
+#include "sgx_edger8r.h"
+#include "user_types.h"
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+sgx_status_t SGX_CDECL ocall_print_string(const char* str);
+sgx_status_t SGX_CDECL ocall_hotcall_idle(void);
+sgx_status_t SGX_CDECL ocall_save_sealed(int* retval, const uint8_t* record, uint32_t length, uint32_t index);
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif
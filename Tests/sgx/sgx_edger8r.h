@@ -0,0 +1,12 @@
+#ifndef _SGX_EDGER8R_H_
+#define _SGX_EDGER8R_H_
+
+//stand-in for the SGX SDK header, for an Enclave_t.h generated by sgx_edger8r
+
+#include <stdint.h>
+#include <stddef.h>
+#include "sgx_error.h"
+
+#define SGX_CDECL
+
+#endif
@@ -0,0 +1,13 @@
+#ifndef _SGX_ERROR_H_
+#define _SGX_ERROR_H_
+
+//stand-in for the SGX SDK header, so Tests/dfatest can build the enclave sources as untrusted code
+
+typedef int sgx_status_t;
+
+#define SGX_SUCCESS 0
+#define SGX_ERROR_UNEXPECTED 1
+#define SGX_ERROR_INVALID_PARAMETER 2
+#define SGX_ERROR_MAC_MISMATCH 0x3001
+
+#endif
@@ -0,0 +1,32 @@
+#ifndef _SGX_TCRYPTO_H_
+#define _SGX_TCRYPTO_H_
+
+//stand-in for the SGX SDK header; Tests/Runtime.cpp implements it with OpenSSL
+
+#include <stdint.h>
+#include <stddef.h>
+#include "sgx_error.h"
+
+typedef uint8_t sgx_aes_gcm_128bit_key_t[16];
+typedef uint8_t sgx_aes_gcm_128bit_tag_t[16];
+typedef uint8_t sgx_sha256_hash_t[32];
+typedef void* sgx_sha_state_handle_t;
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+sgx_status_t sgx_sha256_msg(const uint8_t* p_src, uint32_t src_len, sgx_sha256_hash_t* p_hash);
+sgx_status_t sgx_sha256_init(sgx_sha_state_handle_t* p_sha_handle);
+sgx_status_t sgx_sha256_update(const uint8_t* p_src, uint32_t src_len, sgx_sha_state_handle_t sha_handle);
+sgx_status_t sgx_sha256_get_hash(sgx_sha_state_handle_t sha_handle, sgx_sha256_hash_t* p_hash);
+sgx_status_t sgx_sha256_close(sgx_sha_state_handle_t sha_handle);
+sgx_status_t sgx_rijndael128GCM_decrypt(const sgx_aes_gcm_128bit_key_t* p_key, const uint8_t* p_src, uint32_t src_len,
+    uint8_t* p_dst, const uint8_t* p_iv, uint32_t iv_len, const uint8_t* p_aad, uint32_t aad_len,
+    const sgx_aes_gcm_128bit_tag_t* p_in_mac);
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif
@@ -0,0 +1,20 @@
+#ifndef _SGX_THREAD_H_
+#define _SGX_THREAD_H_
+
+//stand-in for the SGX SDK header: the enclave's mutexes and condition variables become pthread ones
+
+#include <pthread.h>
+
+typedef pthread_mutex_t sgx_thread_mutex_t;
+typedef pthread_cond_t sgx_thread_cond_t;
+
+#define SGX_THREAD_MUTEX_INITIALIZER PTHREAD_MUTEX_INITIALIZER
+#define SGX_THREAD_COND_INITIALIZER PTHREAD_COND_INITIALIZER
+
+#define sgx_thread_mutex_lock pthread_mutex_lock
+#define sgx_thread_mutex_unlock pthread_mutex_unlock
+#define sgx_thread_cond_wait pthread_cond_wait
+#define sgx_thread_cond_signal pthread_cond_signal
+#define sgx_thread_cond_broadcast pthread_cond_broadcast
+
+#endif
@@ -0,0 +1,21 @@
+#ifndef _SGX_TRTS_H_
+#define _SGX_TRTS_H_
+
+//stand-in for the SGX SDK header; Tests/Runtime.cpp implements it
+
+#include <stdint.h>
+#include <stddef.h>
+#include "sgx_error.h"
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+sgx_status_t sgx_read_rand(unsigned char* rand, size_t length); //OpenSSL's RAND_bytes
+int sgx_is_outside_enclave(const void* addr, size_t size); //always 1: every buffer is untrusted memory here
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif
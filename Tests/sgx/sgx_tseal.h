@@ -0,0 +1,43 @@
+#ifndef _SGX_TSEAL_H_
+#define _SGX_TSEAL_H_
+
+//stand-in for the SGX SDK header; Tests/Runtime.cpp seals with AES-128-GCM under a key drawn per process, so a
+//record only unseals in the process that sealed it and any change to it fails the tag check
+
+#include <stdint.h>
+#include <stddef.h>
+#include "sgx_error.h"
+
+#define SGX_KEYPOLICY_MRENCLAVE 0x0001
+
+typedef struct{
+    uint64_t flags;
+    uint64_t xfrm;
+} sgx_attributes_t;
+
+typedef struct{
+    uint32_t plain_text_offset; //the MAC text follows the ciphertext in payload
+    uint32_t payload_size; //ciphertext and MAC text
+    uint8_t iv[12];
+    uint8_t payload_tag[16];
+    uint8_t payload[];
+} sgx_sealed_data_t;
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+uint32_t sgx_calc_sealed_data_size(uint32_t add_mac_txt_size, uint32_t txt_encrypt_size);
+uint32_t sgx_get_add_mac_txt_len(const sgx_sealed_data_t* p_sealed_data);
+uint32_t sgx_get_encrypt_txt_len(const sgx_sealed_data_t* p_sealed_data);
+sgx_status_t sgx_seal_data_ex(uint16_t key_policy, sgx_attributes_t attribute_mask, uint32_t misc_mask,
+    uint32_t additional_MACtext_length, const uint8_t* p_additional_MACtext, uint32_t text2encrypt_length,
+    const uint8_t* p_text2encrypt, uint32_t sealed_data_size, sgx_sealed_data_t* p_sealed_data);
+sgx_status_t sgx_unseal_data(const sgx_sealed_data_t* p_sealed_data, uint8_t* p_additional_MACtext,
+    uint32_t* p_additional_MACtext_length, uint8_t* p_decrypted_text, uint32_t* p_decrypted_text_length);
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif
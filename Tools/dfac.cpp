@@ -0,0 +1,131 @@
+#include <string>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <openssl/sha.h>
+
+#include "Enclave.h"
+
+//dfac: compile newline-separated regexes outside the enclave into an image for loadDFAImage
+//usage: dfac [-k <key file>] <patterns file> <image file>
+//runs the same pipeline as prepDFASet (Automata.cpp and Regex.cpp), so an image loads into exactly the set
+//prepDFASet would build from the same patterns. With -k the image is written encrypted under the 16-byte AES key
+//in the key file, as beginProvision and provisionChunk take it
+
+static int readFile(const char* name, std::string* out){
+    FILE* f = fopen(name, "rb");
+    if(!f) return -1;
+    char buf[4096];
+    size_t n;
+    while((n = fread(buf, 1, sizeof(buf), f)) > 0) out->append(buf, n);
+    int ret = ferror(f) ? -1 : 0;
+    fclose(f);
+    return ret;
+}
+
+static std::string writeImage(Packed_Dfa** dfas, int count){
+    //lay out the packed automata as described in user_types.h and fill in the hash
+    dfa_image_header_t header;
+    std::string image(sizeof(header), '\0');
+    int patterns = 0;
+    for(int d = 0; d < count; d++){
+        const Packed_Dfa* dfa = dfas[d];
+        dfa_image_entry_t entry;
+        dfaEntry(dfa, &entry);
+        image.append((const char*)&entry, sizeof(entry));
+        image.append((const char*)dfa->table, (size_t)dfa->numStates*dfa->rowWords*sizeof(uint64_t));
+        patterns += dfa->acceptBits;
+    }
+    memset(&header, 0, sizeof(header));
+    header.magic = DFA_IMAGE_MAGIC;
+    header.version = DFA_IMAGE_VERSION;
+    header.numDfas = count;
+    header.numPatterns = patterns;
+    header.size = image.size();
+    memcpy(&image[0], &header, sizeof(header));
+    SHA256((const unsigned char*)image.data(), image.size(), header.hash);
+    memcpy(&image[0], &header, sizeof(header));
+    return image;
+}
+
+static int encryptImage(const std::string& image, const unsigned char* key, std::string* out){
+    //split image into PROVISION_CHUNK pieces and seal each with AES-128-GCM as described in user_types.h
+    unsigned char nonce[8];
+    if(RAND_bytes(nonce, sizeof(nonce)) != 1) return -1;
+    out->assign((const char*)nonce, sizeof(nonce));
+    EVP_CIPHER_CTX* ctx = EVP_CIPHER_CTX_new();
+    int ret = ctx ? 0 : -1;
+    for(uint32_t i = 0; ret == 0 && (size_t)i*PROVISION_CHUNK < image.size(); i++){
+        dfa_chunk_header_t chunk;
+        unsigned char iv[12];
+        size_t off = (size_t)i*PROVISION_CHUNK;
+        std::string cipher(image.size()-off < PROVISION_CHUNK ? image.size()-off : PROVISION_CHUNK, '\0');
+        int n = 0;
+        chunk.length = cipher.size();
+        chunk.last = (off+cipher.size() == image.size());
+        memcpy(iv, nonce, sizeof(nonce));
+        memcpy(iv+sizeof(nonce), &i, sizeof(i));
+        if(EVP_EncryptInit_ex(ctx, EVP_aes_128_gcm(), NULL, key, iv) != 1
+            || EVP_EncryptUpdate(ctx, NULL, &n, (const unsigned char*)&chunk.last, sizeof(chunk.last)) != 1
+            || EVP_EncryptUpdate(ctx, (unsigned char*)&cipher[0], &n, (const unsigned char*)image.data()+off, cipher.size()) != 1
+            || EVP_EncryptFinal_ex(ctx, NULL, &n) != 1
+            || EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG, sizeof(chunk.mac), chunk.mac) != 1){
+            ret = -1;
+        }
+        out->append((const char*)&chunk, sizeof(chunk));
+        out->append(cipher);
+    }
+    EVP_CIPHER_CTX_free(ctx);
+    return ret;
+}
+
+int main(int argc, char* argv[])
+{
+    std::string patterns;
+    Staged_Dfa staged[MAX_PATTERNS];
+    Packed_Dfa* packed[MAX_PATTERNS];
+    std::string key;
+    int arg = 1;
+    if(argc == 5 && strcmp(argv[1], "-k") == 0){
+        if(readFile(argv[2], &key) != 0 || key.size() != 16){
+            fprintf(stderr, "%s does not hold a 16-byte key\n", argv[2]);
+            return 1;
+        }
+        arg = 3;
+    }
+    else if(argc != 3){
+        fprintf(stderr, "usage: %s [-k <key file>] <patterns file> <image file>\n", argv[0]);
+        return 1;
+    }
+    if(readFile(argv[arg], &patterns) != 0){
+        fprintf(stderr, "cannot read %s\n", argv[arg]);
+        return 1;
+    }
+
+    int count = stagePatterns(patterns.c_str(), staged);
+    int num = count < 0 ? -1 : packDFASet(staged, count, packed);
+    if(num < 0){
+        fprintf(stderr, "could not compile %s%s\n", argv[arg], count == DFA_TOO_LARGE ? ": a pattern is too large" : "");
+        return 1;
+    }
+    std::string image = writeImage(packed, num);
+    for(int d = 0; d < num; d++){
+        printf("automaton %d: %d patterns, %d states, %d classes\n", d, packed[d]->acceptBits, packed[d]->numStates, packed[d]->numClasses);
+        freeDFA(packed[d]);
+    }
+
+    if(!key.empty()){
+        std::string plain = image;
+        if(encryptImage(plain, (const unsigned char*)key.data(), &image) != 0){
+            fprintf(stderr, "could not encrypt the image\n");
+            return 1;
+        }
+    }
+
+    FILE* f = fopen(argv[arg+1], "wb");
+    if(!f || fwrite(image.data(), 1, image.size(), f) != image.size() || fclose(f) != 0){
+        fprintf(stderr, "cannot write %s\n", argv[arg+1]);
+        return 1;
+    }
+    printf("wrote %zu bytes to %s\n", image.size(), argv[arg+1]);
+    return 0;
+}